@@ -8,27 +8,114 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <termios.h>
 #include <unistd.h>
 #include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 2
+#define KILO_MAX_FPS 60
+#define KILO_HL_MAX_THREADS 64
+#define KILO_HL_PARALLEL_MIN_ROWS 4096
+#define KILO_LOAD_BATCH 4096
+#define KILO_LOAD_TICK_ROWS 32768
+#define KILO_FOLLOW_READ 65536
+#define KILO_FILTER_READ 65536
+#define KILO_FILTER_IOV 512
+#define KILO_DIFF_MAX_D 8192
+#define KILO_SESSION_MAGIC "KILOSES1"
+#define KILO_SESSION_MIN_ROWS 4096
+#define KILO_CHUNK_SIZE 4096
+#define KILO_ECH_MIN 10
+#define KILO_LEX_LOOKAHEAD 32
+#define KILO_TABLE_SAMPLE 256
+#define KILO_TABLE_COL_MAX 40
+#define KILO_MEM_BUDGET_MB 512
 
 /* *** DATA TYPES *** */
 
+typedef struct hl_span {
+    int start;
+    int len;
+    unsigned char hl;
+} hl_span;
+
+typedef struct hl_list {
+    hl_span *span;
+    int len;
+    int cap;
+} hl_list;
+
+typedef struct hl_cursor {
+    int chunk;
+    int span;
+} hl_cursor;
+
+#define HL_CURSOR_INIT { -1 , 0 }
+
+/* Where the lexer stands between two ranges of a row. */
+struct lex_state {
+    int in_comment;
+    int in_string;
+    int in_line_comment;
+    int prev_sep;
+    unsigned char prev_hl;
+    int skip;               /* bytes of a token that began in the previous range */
+    unsigned char skip_hl;
+};
+
+/* Rows longer than KILO_CHUNK_SIZE are split into chunks that remember
+ * where they start, in bytes and in rendered columns, and the lexer state
+ * on entry, so an edit only re-renders and re-lexes the chunks around it. */
+typedef struct row_chunk {
+    int cx;
+    int rx;
+    int special;
+    struct lex_state entry;
+    hl_list hl;             /* relative to cx */
+} row_chunk;
+
+/* One character cell of the screen: the UTF-8 bytes of the character
+ * shown there and of any zero-width marks on it, NUL padded. The right
+ * half of a wide character is a cell with no bytes. attr is an SGR
+ * foreground colour, with CELL_INVERSE added for reverse video. */
+typedef struct cell {
+    char ch[7];
+    unsigned char attr;
+} cell;
+
+#define CELL_DEFAULT 39
+#define CELL_INVERSE 0x80
+
+const cell CELL_BLANK = {" ", CELL_DEFAULT};
+
 typedef struct erow {
     int idx;
     int size;
     int rsize;
+    int special;            /* tabs and non-ASCII bytes; with none a byte is a column */
     char *chars;
-    char *render;
-    unsigned char *hl;
+    hl_list hl;
+    row_chunk *chunks;
+    int num_chunks;
     int hl_open_comment;
+    int hl_pending;         /* not lexed yet, hl_open_comment came from a session cache */
+    unsigned long long hash;    /* of chars for the diff view, 0 until needed */
+    int *fields;            /* where each field starts for the table view, NULL until needed */
+    int num_fields;
 } erow;
 
 struct editor_config {
@@ -41,10 +128,41 @@ struct editor_config {
     int num_rows;
     erow *row;
     int dirty;
+    unsigned long edits;    /* bumped by every row edit */
     char *filename;
     char status_msg[80];
     time_t status_msg_time;
     struct editor_syntax *syntax;
+    struct editor_loader *loader;
+    off_t loaded_bytes;
+    struct editor_follow *follow;
+    struct editor_undo *undo;
+    struct editor_filter *filter;
+    struct editor_diff *diff;
+    struct editor_wrap *wrap;
+    struct editor_table *table;
+    cell *frame;            /* the screen as last written to the terminal */
+    int frame_row_off;
+    int term_x, term_y;     /* cursor position, or -1 when unknown */
+    int term_attr;          /* current SGR attributes, or -1 when unknown */
+    long out_frames;
+    long out_bytes;
+    long out_full_bytes;    /* what redrawing every frame in full would take */
+    long frame_time;        /* when the last frame went out, in ms */
+    int frame_interval;     /* least time between frames, in ms */
+    int redraw_pending;     /* a background change is waiting to be drawn */
+    int mark_row;           /* where the selection starts, or -1 */
+    char **kill_lines;
+    int *kill_lens;
+    int kill_num;
+    int match_row;
+    int match_start;
+    int match_len;
+    struct editor_buffer *buffers;  /* the open buffers; the current one lives in econf */
+    int num_buffers;
+    int cur_buffer;
+    unsigned long buffer_clock; /* ticks on every switch, to order buffers by last use */
+    size_t mem_budget;      /* bytes all buffers may take before background ones are trimmed */
     struct termios original_termios;
 };
 
@@ -78,7 +196,9 @@ enum editor_highlight {
     HL_KEYWORD2,
     HL_STRING,
     HL_NUMBER,
-    HL_MATCH
+    HL_MATCH,
+    HL_DIFF_OLD,
+    HL_DIFF_NEW
 };
 
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
@@ -92,8 +212,35 @@ struct editor_syntax {
     char *multiline_comment_start;
     char *multiline_comment_end;
     int flags;
+    struct lex_table *table;
+};
+
+/* A syntax compiled for the lexer: a class for every byte value, and the
+ * keywords grouped by their first byte, each group in HLDB order. */
+struct lex_table {
+    unsigned char cls[256];
+    int kw_first[257];          /* keywords starting with c are [kw_first[c], kw_first[c + 1]) */
+    char **kw;
+    int *kw_len;
+    unsigned char *kw_hl;
+    int scs_len;
+    int mcs_len;
+    int mce_len;
 };
 
+#define LEX_SEP (1<<0)
+#define LEX_DIGIT (1<<1)
+#define LEX_DOT (1<<2)
+#define LEX_QUOTE (1<<3)
+#define LEX_SCS (1<<4)
+#define LEX_MCS (1<<5)
+#define LEX_KW (1<<6)
+
+/* Classes that start a token wherever they are, and those that only do
+ * right after a separator. */
+#define LEX_ANYWHERE (LEX_QUOTE | LEX_SCS | LEX_MCS)
+#define LEX_AFTER_SEP (LEX_ANYWHERE | LEX_DIGIT | LEX_KW)
+
 /* *** FILETYPES *** */
 
 char *C_HL_extensions[] = { ".c" , ".h" , ".cpp" , NULL };
@@ -118,14 +265,16 @@ struct editor_syntax HLDB[] = {
         C_HL_extensions,
         C_HL_keywords,
         "//", "/*", "*/",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        NULL
     },
     {
         "F#",
         FS_HL_extensions,
         FS_HL_keywords,
         "//", NULL, NULL,
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        NULL
     }
 };
 
@@ -135,8 +284,24 @@ struct editor_syntax HLDB[] = {
 /* *** PROTOTYPES *** */
 
 void editor_set_status_message(const char *fmt, ...);
+void editor_scroll();
 void editor_refresh_screen();
-char *editor_prompt(char *prompt, void (*callback)(char *, int));
+int editor_background_tick();
+int editor_filter_wait();
+int editor_session_load(char *filename);
+int editor_text_cols();
+void editor_draw_row(cell *line, int y);
+void editor_draw_text(cell *line, erow *row, int col_off, int width, int diff_hl);
+void editor_wrap_update(erow *row);
+void editor_wrap_insert(int at, int n);
+void editor_wrap_delete(int at, int n);
+void editor_wrap_free();
+void editor_table_free();
+int editor_draw_chars(cell *line, int width, const char *s, int size, int cx, int rx,
+                      int col_off, erow *row, int attr);
+int editor_row_selected(erow *row);
+char *editor_prompt(char *prompt, void (*callback)(char *, int), int allow_empty);
+void editor_show_output_stats();
 
 /* *** ABUF *** */
 
@@ -190,12 +355,48 @@ void enable_raw_mode() {
         die("tcsetattr");
 }
 
+int editor_input_ready() {
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    return poll(&pfd, 1, 0) > 0;
+}
+
+long editor_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* Returns how many ms are left before the next frame may be drawn. */
+int editor_frame_delay() {
+    long left = econf.frame_time + econf.frame_interval - editor_now_ms();
+    return left > 0 ? left : 0;
+}
+
+/* Returns 1 if a key arrives before the next frame is due, waiting for it
+ * until then at most. Keys typed ahead are handled before redrawing, so no
+ * frame is drawn that the next key would replace straight away. */
+int editor_input_pending() {
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    return poll(&pfd, 1, editor_frame_delay()) > 0;
+}
+
 int editor_read_key() {
     int nread;
     char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN)
-            die("read");
+    int busy = 0;
+    while (1) {
+        /* Only block in read() when there is no background work waiting.
+         * A running filter is waited on together with the keyboard. */
+        if (!busy && econf.filter)
+            busy = !editor_filter_wait();
+        if (!busy || editor_input_ready()) {
+            nread = read(STDIN_FILENO, &c, 1);
+            if (nread == 1)
+                break;
+            if (nread == -1 && errno != EAGAIN)
+                die("read");
+        }
+        busy = editor_background_tick();
     }
 
     if (c == '\x1b') {
@@ -249,120 +450,474 @@ int is_seperator(int c) {
     return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
 
-void editor_update_syntax(erow *row) {
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
-
-    if (econf.syntax == NULL) return;
+/* Highlighting is kept as sorted lists of non-overlapping spans over
+ * row->chars, one per row or, for chunked rows, one per chunk. Bytes not
+ * covered by any span are HL_NORMAL. */
+void editor_hl_push(hl_list *list, int start, int len, unsigned char hl) {
+    if (len <= 0 || hl == HL_NORMAL) return;
 
-    char **keywords = econf.syntax->keywords;
+    if (list->len > 0) {
+        hl_span *last = &list->span[list->len - 1];
+        if (last->hl == hl && last->start + last->len == start) {
+            last->len += len;
+            return;
+        }
+    }
 
-    char *scs = econf.syntax-> singleline_comment_start;
-    char *mcs = econf.syntax-> multiline_comment_start;
-    char *mce = econf.syntax-> multiline_comment_end;
+    if (list->len == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 8;
+        list->span = realloc(list->span, sizeof(hl_span) * list->cap);
+    }
+    list->span[list->len].start = start;
+    list->span[list->len].len = len;
+    list->span[list->len].hl = hl;
+    list->len++;
+}
 
-    int scs_len = scs ? strlen(scs) : 0;
-    int mcs_len = mcs ? strlen(mcs) : 0;
-    int mce_len = mce ? strlen(mce) : 0;
+unsigned char editor_hl_before(hl_list *list, int at) {
+    if (list->len == 0) return HL_NORMAL;
+    hl_span *last = &list->span[list->len - 1];
+    return (last->start + last->len == at) ? last->hl : HL_NORMAL;
+}
 
-    int prev_sep = 1;
-    int in_string = 0;
-    int in_comment = (row->idx > 0 && econf.row[row->idx - 1].hl_open_comment);
+/* Returns the index of the chunk holding chars[cx]. */
+int editor_row_find_chunk(erow *row, int cx) {
+    int lo = 0, hi = row->num_chunks - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (row->chunks[mid].cx <= cx) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
 
-    int i = 0;
-    while (i < row->rsize) {
-        char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i -1] : HL_NORMAL;
+int editor_row_chunk_end(erow *row, int c) {
+    return (c + 1 < row->num_chunks) ? row->chunks[c + 1].cx : row->size;
+}
 
-        if (scs_len && !in_string && !in_comment) {
-            if (!strncmp(&row->render[i], scs, scs_len)) {
-                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-                break;
+/* Returns the class of chars[at] and stores in *end the index where the
+ * run starting there stops. cur only ever moves forward, so walking a row
+ * left to right is linear in its spans. Start it at HL_CURSOR_INIT. */
+int editor_hl_run(erow *row, hl_cursor *cur, int at, int *end) {
+    hl_list *list = &row->hl;
+    int base = 0;
+    int hl = HL_NORMAL;
+    *end = row->size;
+
+    if (row->chunks) {
+        if (cur->chunk < 0) {
+            cur->chunk = editor_row_find_chunk(row, at);
+        } else {
+            while (cur->chunk + 1 < row->num_chunks && row->chunks[cur->chunk + 1].cx <= at) {
+                cur->chunk++;
+                cur->span = 0;
             }
         }
+        list = &row->chunks[cur->chunk].hl;
+        base = row->chunks[cur->chunk].cx;
+        *end = editor_row_chunk_end(row, cur->chunk);
+    }
 
-        if (mcs_len && mce_len && !in_string) {
-            if (in_comment) {
-                row->hl[i] = HL_MLCOMMENT;
-                if (!strncmp(&row->render[i], mce, mce_len)) {
-                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-                    i += mce_len;
-                    in_comment = 0;
-                    prev_sep = 1;
-                    continue;
-                } else {
-                    i++;
-                    continue;
-                }
-            } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-                i += mcs_len;
-                in_comment = 1;
-                continue;
-            }
+    while (cur->span < list->len && base + list->span[cur->span].start + list->span[cur->span].len <= at)
+        cur->span++;
+    if (cur->span < list->len) {
+        hl_span *sp = &list->span[cur->span];
+        if (base + sp->start <= at) {
+            hl = sp->hl;
+            *end = base + sp->start + sp->len;
+        } else {
+            *end = base + sp->start;
         }
+    }
 
-        if (econf.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-            if (in_string) {
-                row->hl[i] = HL_STRING;
-                if (c == '\\' && i + 1 < row->rsize) {
-                    row->hl[i + 1] = HL_STRING;
-                    i += 2;
-                    continue;
-                }
-                if (c == in_string) in_string = 0;
-                i++;
+    if (row->idx == econf.match_row) {
+        int match_end = econf.match_start + econf.match_len;
+        if (at >= econf.match_start && at < match_end) {
+            hl = HL_MATCH;
+            *end = match_end;
+        } else if (at < econf.match_start && *end > econf.match_start) {
+            *end = econf.match_start;
+        }
+    }
+    return hl;
+}
+
+void editor_lex_init(struct lex_state *st, int in_comment) {
+    st->in_comment = in_comment;
+    st->in_string = 0;
+    st->in_line_comment = 0;
+    st->prev_sep = 1;
+    st->prev_hl = HL_NORMAL;
+    st->skip = 0;
+    st->skip_hl = HL_NORMAL;
+}
+
+int editor_lex_state_equal(struct lex_state *a, struct lex_state *b) {
+    return a->in_comment == b->in_comment && a->in_string == b->in_string &&
+        a->in_line_comment == b->in_line_comment && a->prev_sep == b->prev_sep &&
+        a->prev_hl == b->prev_hl && a->skip == b->skip && a->skip_hl == b->skip_hl;
+}
+
+/* Pushes a span found while lexing up to to. A token running past to is
+ * cut there and the rest is left to the next range through st->skip_hl. */
+void editor_lex_push(hl_list *out, int base, int to, struct lex_state *st,
+                     int start, int len, unsigned char hl) {
+    if (start + len > to) {
+        st->skip_hl = hl;
+        len = to - start;
+    }
+    editor_hl_push(out, start - base, len, hl);
+}
+
+/* Compiles syntax into the tables the lexer runs on, unless done before. */
+void editor_compile_syntax(struct editor_syntax *syntax) {
+    if (syntax->table) return;
+    struct lex_table *t = calloc(1, sizeof(struct lex_table));
+
+    char *scs = syntax->singleline_comment_start;
+    char *mcs = syntax->multiline_comment_start;
+    char *mce = syntax->multiline_comment_end;
+    t->scs_len = scs ? strlen(scs) : 0;
+    if (mcs && mce && *mcs && *mce) {
+        t->mcs_len = strlen(mcs);
+        t->mce_len = strlen(mce);
+    }
+
+    for (int c = 0; c < 256; c++) {
+        if (is_seperator(c)) t->cls[c] |= LEX_SEP;
+        if (syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+            if (isdigit(c)) t->cls[c] |= LEX_DIGIT;
+            if (c == '.') t->cls[c] |= LEX_DOT;
+        }
+        if ((syntax->flags & HL_HIGHLIGHT_STRINGS) && (c == '"' || c == '\''))
+            t->cls[c] |= LEX_QUOTE;
+    }
+    if (t->scs_len) t->cls[(unsigned char)scs[0]] |= LEX_SCS;
+    if (t->mcs_len) t->cls[(unsigned char)mcs[0]] |= LEX_MCS;
+
+    /* A counting sort on the first byte keeps each group in HLDB order, so
+     * the first keyword that matches still wins. */
+    char **keywords = syntax->keywords;
+    int n = 0;
+    while (keywords[n]) n++;
+    t->kw = malloc(sizeof(char *) * (n + 1));
+    t->kw_len = malloc(sizeof(int) * (n + 1));
+    t->kw_hl = malloc(n + 1);
+    for (int j = 0; j < n; j++)
+        t->kw_first[(unsigned char)keywords[j][0] + 1]++;
+    for (int c = 0; c < 256; c++)
+        t->kw_first[c + 1] += t->kw_first[c];
+
+    int next[256];
+    memcpy(next, t->kw_first, sizeof(next));
+    for (int j = 0; j < n; j++) {
+        unsigned char c = keywords[j][0];
+        int at = next[c]++;
+        int len = strlen(keywords[j]);
+        int kw2 = keywords[j][len - 1] == '|';
+        t->kw[at] = keywords[j];
+        t->kw_len[at] = kw2 ? len - 1 : len;
+        t->kw_hl[at] = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+        t->cls[c] |= LEX_KW;
+    }
+    syntax->table = t;
+}
+
+/* Lexes chars[from, to) of a row of the given size, carrying on from *st,
+ * and appends the spans found to out relative to base. The lexer may look
+ * at bytes past to, and whatever it consumed there is skipped by the next
+ * range. Only out and *st are touched, so rows can be lexed from several
+ * threads at once.
+ *
+ * Bytes are looked up in the syntax's class table. Runs of bytes that start
+ * no token are passed over in a tight loop, and comments and strings are
+ * pushed as whole runs up to the next byte that could end them. */
+void editor_lex(struct editor_syntax *syntax, char *chars, int size, int from, int to,
+                struct lex_state *st, hl_list *out, int base) {
+    struct lex_table *t = syntax->table;
+    unsigned char *cls = t->cls;
+    char *scs = syntax->singleline_comment_start;
+    char *mcs = syntax->multiline_comment_start;
+    char *mce = syntax->multiline_comment_end;
+
+    int prev_sep = st->prev_sep;
+    int in_string = st->in_string;
+    int in_comment = st->in_comment;
+    unsigned char prev_hl = st->prev_hl;
+
+    int i = from;
+    if (st->skip > 0) {
+        editor_hl_push(out, from - base, st->skip < to - from ? st->skip : to - from, st->skip_hl);
+        i += st->skip;
+        prev_hl = st->skip_hl;
+    }
+    if (st->in_line_comment) {
+        editor_hl_push(out, from - base, to - from, HL_COMMENT);
+        i = to;
+    }
+
+    while (i < to) {
+        if (in_comment && t->mce_len) {
+            char *end = memchr(&chars[i], mce[0], to - i);
+            int stop = end ? end - chars : to;
+            if (stop > i) {
+                editor_hl_push(out, i - base, stop - i, HL_MLCOMMENT);
+                i = stop;
+            } else if (!strncmp(&chars[i], mce, t->mce_len)) {
+                editor_lex_push(out, base, to, st, i, t->mce_len, HL_MLCOMMENT);
+                i += t->mce_len;
+                in_comment = 0;
                 prev_sep = 1;
-                continue;
             } else {
-                if (c == '"' || c == '\'') {
-                    in_string = c;
-                    row->hl[i] = HL_STRING;
-                    i++;
-                    continue;
-                }
+                editor_hl_push(out, i - base, 1, HL_MLCOMMENT);
+                i++;
             }
+            prev_hl = HL_MLCOMMENT;
+            continue;
         }
 
-        if (econf.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-            if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) || (c == '.' && prev_hl == HL_NUMBER)) {
-                row->hl[i] = HL_NUMBER;
+        if (in_string) {
+            int stop = i;
+            while (stop < to && chars[stop] != in_string && chars[stop] != '\\') stop++;
+            if (stop > i) {
+                editor_hl_push(out, i - base, stop - i, HL_STRING);
+                i = stop;
+                prev_sep = 1;
+            } else if (chars[i] == '\\' && i + 1 < size) {
+                editor_lex_push(out, base, to, st, i, 2, HL_STRING);
+                i += 2;
+            } else {
+                editor_hl_push(out, i - base, 1, HL_STRING);
+                if (chars[i] == in_string) in_string = 0;
                 i++;
-                prev_sep = 0;
-                continue;
+                prev_sep = 1;
             }
+            prev_hl = HL_STRING;
+            continue;
         }
 
-        if (prev_sep) {
+        int start = i;
+        while (i < to) {
+            int k = cls[(unsigned char)chars[i]];
+            if (k & (prev_sep ? LEX_AFTER_SEP : LEX_ANYWHERE)) break;
+            if (prev_hl == HL_NUMBER && (k & (LEX_DIGIT | LEX_DOT))) break;
+            prev_sep = k & LEX_SEP;
+            prev_hl = HL_NORMAL;
+            i++;
+        }
+        if (i == to) break;
+        if (i > start) continue;
+
+        unsigned char c = chars[i];
+        int k = cls[c];
+        if ((k & LEX_SCS) && !in_comment && !strncmp(&chars[i], scs, t->scs_len)) {
+            editor_hl_push(out, i - base, to - i, HL_COMMENT);
+            st->in_line_comment = 1;
+            i = to;
+            break;
+        }
+        if ((k & LEX_MCS) && !strncmp(&chars[i], mcs, t->mcs_len)) {
+            editor_lex_push(out, base, to, st, i, t->mcs_len, HL_MLCOMMENT);
+            i += t->mcs_len;
+            in_comment = 1;
+            prev_hl = HL_MLCOMMENT;
+            continue;
+        }
+        if (k & LEX_QUOTE) {
+            in_string = c;
+            editor_hl_push(out, i - base, 1, HL_STRING);
+            i++;
+            prev_hl = HL_STRING;
+            continue;
+        }
+        if (((k & LEX_DIGIT) && (prev_sep || prev_hl == HL_NUMBER)) ||
+            ((k & LEX_DOT) && prev_hl == HL_NUMBER)) {
+            editor_hl_push(out, i - base, 1, HL_NUMBER);
+            i++;
+            prev_sep = 0;
+            prev_hl = HL_NUMBER;
+            continue;
+        }
+        if (prev_sep && (k & LEX_KW)) {
             int j;
-            for (j = 0; keywords[j]; j++) {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen - 1] == '|';
-                if (kw2) klen--;
-
-                if (!strncmp(&row->render[i], keywords[j], klen) &&
-                    is_seperator(row->render[i + klen])) {
-                    memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                    i += klen;
+            for (j = t->kw_first[c]; j < t->kw_first[c + 1]; j++) {
+                int klen = t->kw_len[j];
+                if (!strncmp(&chars[i], t->kw[j], klen) &&
+                    (cls[(unsigned char)chars[i + klen]] & LEX_SEP))
                     break;
-                }
             }
-            if (keywords[j] != NULL) {
+            if (j < t->kw_first[c + 1]) {
+                editor_lex_push(out, base, to, st, i, t->kw_len[j], t->kw_hl[j]);
+                i += t->kw_len[j];
                 prev_sep = 0;
+                prev_hl = t->kw_hl[j];
                 continue;
             }
         }
 
-        prev_sep = is_seperator(c);
+        prev_sep = k & LEX_SEP;
+        prev_hl = HL_NORMAL;
         i++;
     }
 
+    st->prev_sep = prev_sep;
+    st->in_string = in_string;
+    st->in_comment = in_comment;
+    st->skip = i - to;
+    if (st->skip == 0) st->skip_hl = HL_NORMAL;
+    st->prev_hl = editor_hl_before(out, to - base);
+}
+
+/* Lexes a whole row entered with the given multiline comment state and
+ * returns the state it leaves open. */
+int editor_lex_row(struct editor_syntax *syntax, erow *row, int in_comment) {
+    struct lex_state st;
+    editor_lex_init(&st, in_comment);
+
+    row->hl.len = 0;
+    row->hl_pending = 0;
+    if (row->chunks == NULL) {
+        editor_lex(syntax, row->chars, row->size, 0, row->size, &st, &row->hl, 0);
+        return st.in_comment;
+    }
+
+    for (int c = 0; c < row->num_chunks; c++) {
+        row_chunk *chunk = &row->chunks[c];
+        chunk->entry = st;
+        chunk->hl.len = 0;
+        editor_lex(syntax, row->chars, row->size, chunk->cx, editor_row_chunk_end(row, c),
+                   &st, &chunk->hl, chunk->cx);
+    }
+    return st.in_comment;
+}
+
+void editor_update_syntax(erow *row) {
+    row->hl.len = 0;
+
+    if (econf.syntax == NULL) return;
+
+    int in_comment = (row->idx > 0 && econf.row[row->idx - 1].hl_open_comment);
+    in_comment = editor_lex_row(econf.syntax, row, in_comment);
+
     int changed = (row->hl_open_comment != in_comment);
     row->hl_open_comment = in_comment;
     if (changed && row->idx + 1 < econf.num_rows)
         editor_update_syntax(&econf.row[row->idx + 1]);
 }
 
+/* Parallel highlighting splits a range of rows into one chunk per thread.
+ * Every chunk but the first is lexed twice: once assuming it starts outside
+ * a multiline comment, straight into the rows, and once assuming it starts
+ * inside one, into side copies. The second pass stops as soon as its comment
+ * state agrees with the first, since every row after that lexes the same.
+ * Once all threads are done the real entry state of each chunk is known and
+ * a serial pass swaps in the side copies where the guess was wrong. */
+struct hl_chunk {
+    struct editor_syntax *syntax;
+    erow *rows;
+    int num_rows;
+    int entry;          /* known entry state, or -1 when speculating */
+    int out[2];         /* state left open after the chunk, per entry state */
+    erow *alt;          /* rows as lexed when entered inside a comment */
+    int alt_rows;
+};
+
+void *editor_hl_chunk_worker(void *arg) {
+    struct hl_chunk *chunk = arg;
+    int in_comment = (chunk->entry == 1);
+    int j;
+
+    for (j = 0; j < chunk->num_rows; j++) {
+        in_comment = editor_lex_row(chunk->syntax, &chunk->rows[j], in_comment);
+        chunk->rows[j].hl_open_comment = in_comment;
+    }
+    chunk->out[0] = chunk->out[1] = in_comment;
+    if (chunk->entry != -1) return NULL;
+
+    chunk->alt = calloc(chunk->num_rows, sizeof(erow));
+    in_comment = 1;
+    for (j = 0; j < chunk->num_rows; j++) {
+        erow *alt = &chunk->alt[j];
+        alt->chars = chunk->rows[j].chars;
+        alt->size = chunk->rows[j].size;
+        in_comment = editor_lex_row(chunk->syntax, alt, in_comment);
+        alt->hl_open_comment = in_comment;
+        chunk->alt_rows = j + 1;
+        if (in_comment == chunk->rows[j].hl_open_comment)
+            return NULL;
+    }
+    chunk->out[1] = in_comment;
+    return NULL;
+}
+
+/* Highlights rows [from, to) in one go, then carries a changed comment state
+ * on into the rows that follow. */
+void editor_highlight_rows(int from, int to) {
+    if (econf.syntax == NULL || from >= to) return;
+
+    int old_open = econf.row[to - 1].hl_open_comment;
+    int entry = (from > 0 && econf.row[from - 1].hl_open_comment);
+
+    int num_chunks = 1;
+    if (to - from >= KILO_HL_PARALLEL_MIN_ROWS)
+        num_chunks = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_chunks > KILO_HL_MAX_THREADS) num_chunks = KILO_HL_MAX_THREADS;
+    if (num_chunks < 2) {
+        for (int j = from; j < to; j++) {
+            entry = editor_lex_row(econf.syntax, &econf.row[j], entry);
+            econf.row[j].hl_open_comment = entry;
+        }
+    } else {
+        struct hl_chunk chunks[KILO_HL_MAX_THREADS];
+        pthread_t threads[KILO_HL_MAX_THREADS];
+        int started[KILO_HL_MAX_THREADS];
+        int per_chunk = (to - from + num_chunks - 1) / num_chunks;
+        int c, j;
+
+        for (c = 0; c < num_chunks; c++) {
+            int start = from + c * per_chunk;
+            int end = start + per_chunk < to ? start + per_chunk : to;
+            chunks[c].syntax = econf.syntax;
+            chunks[c].rows = &econf.row[start < to ? start : to];
+            chunks[c].num_rows = end > start ? end - start : 0;
+            chunks[c].entry = (c == 0) ? entry : -1;
+            chunks[c].alt = NULL;
+            chunks[c].alt_rows = 0;
+            started[c] = (pthread_create(&threads[c], NULL, editor_hl_chunk_worker, &chunks[c]) == 0);
+            if (!started[c])
+                editor_hl_chunk_worker(&chunks[c]);
+        }
+        for (c = 0; c < num_chunks; c++) {
+            if (started[c])
+                pthread_join(threads[c], NULL);
+        }
+
+        for (c = 0; c < num_chunks; c++) {
+            struct hl_chunk *chunk = &chunks[c];
+            for (j = 0; j < chunk->alt_rows; j++) {
+                erow *row = &chunk->rows[j];
+                erow *alt = &chunk->alt[j];
+                if (entry == 1 && row->chunks) {
+                    /* Side copies are lexed unchunked; redo chunked rows. */
+                    int row_entry = (j == 0) ? 1 : row[-1].hl_open_comment;
+                    row->hl_open_comment = editor_lex_row(econf.syntax, row, row_entry);
+                } else if (entry == 1) {
+                    hl_list hl = row->hl;
+                    row->hl = alt->hl;
+                    row->hl_open_comment = alt->hl_open_comment;
+                    alt->hl = hl;
+                }
+                free(alt->hl.span);
+            }
+            free(chunk->alt);
+            entry = chunk->out[entry];
+        }
+    }
+
+    if (to < econf.num_rows && econf.row[to - 1].hl_open_comment != old_open)
+        editor_update_syntax(&econf.row[to]);
+}
+
 int editor_syntax_to_color(int hl) {
     switch (hl) {
     case HL_COMMENT:
@@ -372,6 +927,8 @@ int editor_syntax_to_color(int hl) {
     case HL_STRING: return 35;
     case HL_NUMBER: return 31;
     case HL_MATCH: return 34;
+    case HL_DIFF_OLD: return 31;
+    case HL_DIFF_NEW: return 32;
     default: return 37;
     }
 }
@@ -389,13 +946,9 @@ void editor_select_syntax_highlight() {
             int is_ext = (s->filematch[i][0] == '.');
             if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
                 (!is_ext && strstr(econf.filename, s->filematch[i]))) {
+                editor_compile_syntax(s);
                 econf.syntax = s;
-
-                int file_row;
-                for (file_row = 0; file_row < econf.num_rows; file_row++) {
-                    editor_update_syntax(&econf.row[file_row]);
-                }
-
+                editor_highlight_rows(0, econf.num_rows);
                 return;
             }
             i++;
@@ -403,89 +956,514 @@ void editor_select_syntax_highlight() {
     }
 }
 
+/* *** UTF-8 *** */
+
+/* Code points that are not one column wide: marks drawn over the character
+ * before them, and East Asian wide characters and emoji. The ranges are
+ * sorted; everything below the first one is a single column. */
+struct width_range {
+    unsigned int first, last;
+    unsigned char width;
+};
+
+struct width_range WIDTH_RANGES[] = {
+    {0x0300, 0x036F, 0}, {0x0483, 0x0489, 0}, {0x0591, 0x05BD, 0}, {0x05BF, 0x05BF, 0},
+    {0x05C1, 0x05C2, 0}, {0x05C4, 0x05C5, 0}, {0x05C7, 0x05C7, 0}, {0x0610, 0x061A, 0},
+    {0x064B, 0x065F, 0}, {0x0670, 0x0670, 0}, {0x06D6, 0x06DC, 0}, {0x06DF, 0x06E4, 0},
+    {0x06E7, 0x06E8, 0}, {0x06EA, 0x06ED, 0}, {0x0711, 0x0711, 0}, {0x0730, 0x074A, 0},
+    {0x0900, 0x0902, 0}, {0x093A, 0x093A, 0}, {0x093C, 0x093C, 0}, {0x0941, 0x0948, 0},
+    {0x094D, 0x094D, 0}, {0x0951, 0x0957, 0}, {0x0962, 0x0963, 0}, {0x0E31, 0x0E31, 0},
+    {0x0E34, 0x0E3A, 0}, {0x0E47, 0x0E4E, 0}, {0x1100, 0x115F, 2}, {0x1160, 0x11FF, 0},
+    {0x1AB0, 0x1AFF, 0}, {0x1DC0, 0x1DFF, 0}, {0x200B, 0x200F, 0}, {0x202A, 0x202E, 0},
+    {0x2060, 0x2064, 0}, {0x20D0, 0x20FF, 0}, {0x231A, 0x231B, 2}, {0x2329, 0x232A, 2},
+    {0x23E9, 0x23EC, 2}, {0x23F0, 0x23F0, 2}, {0x23F3, 0x23F3, 2}, {0x25FD, 0x25FE, 2},
+    {0x2614, 0x2615, 2}, {0x2648, 0x2653, 2}, {0x267F, 0x267F, 2}, {0x2693, 0x2693, 2},
+    {0x26A1, 0x26A1, 2}, {0x26AA, 0x26AB, 2}, {0x26BD, 0x26BE, 2}, {0x26C4, 0x26C5, 2},
+    {0x26CE, 0x26CE, 2}, {0x26D4, 0x26D4, 2}, {0x26EA, 0x26EA, 2}, {0x26F2, 0x26F3, 2},
+    {0x26F5, 0x26F5, 2}, {0x26FA, 0x26FA, 2}, {0x26FD, 0x26FD, 2}, {0x2705, 0x2705, 2},
+    {0x270A, 0x270B, 2}, {0x2728, 0x2728, 2}, {0x274C, 0x274C, 2}, {0x274E, 0x274E, 2},
+    {0x2753, 0x2755, 2}, {0x2757, 0x2757, 2}, {0x2795, 0x2797, 2}, {0x27B0, 0x27B0, 2},
+    {0x27BF, 0x27BF, 2}, {0x2B1B, 0x2B1C, 2}, {0x2B50, 0x2B50, 2}, {0x2B55, 0x2B55, 2},
+    {0x2E80, 0x3029, 2}, {0x302A, 0x302D, 0}, {0x302E, 0x303E, 2}, {0x3041, 0x3098, 2},
+    {0x3099, 0x309A, 0}, {0x309B, 0x33FF, 2}, {0x3400, 0x4DBF, 2}, {0x4E00, 0x9FFF, 2},
+    {0xA000, 0xA4CF, 2}, {0xA960, 0xA97F, 2}, {0xAC00, 0xD7A3, 2}, {0xF900, 0xFAFF, 2},
+    {0xFE00, 0xFE0F, 0}, {0xFE10, 0xFE19, 2}, {0xFE20, 0xFE2F, 0}, {0xFE30, 0xFE6F, 2},
+    {0xFEFF, 0xFEFF, 0}, {0xFF00, 0xFF60, 2}, {0xFFE0, 0xFFE6, 2}, {0x16FE0, 0x16FE4, 2},
+    {0x17000, 0x18CFF, 2}, {0x1B000, 0x1B2FF, 2}, {0x1F004, 0x1F004, 2}, {0x1F0CF, 0x1F0CF, 2},
+    {0x1F18E, 0x1F18E, 2}, {0x1F191, 0x1F19A, 2}, {0x1F200, 0x1F202, 2}, {0x1F210, 0x1F23B, 2},
+    {0x1F240, 0x1F248, 2}, {0x1F250, 0x1F251, 2}, {0x1F260, 0x1F265, 2}, {0x1F300, 0x1F320, 2},
+    {0x1F32D, 0x1F335, 2}, {0x1F337, 0x1F37C, 2}, {0x1F37E, 0x1F393, 2}, {0x1F3A0, 0x1F3CA, 2},
+    {0x1F3CF, 0x1F3D3, 2}, {0x1F3E0, 0x1F3F0, 2}, {0x1F3F4, 0x1F3F4, 2}, {0x1F3F8, 0x1F43E, 2},
+    {0x1F440, 0x1F440, 2}, {0x1F442, 0x1F4FC, 2}, {0x1F4FF, 0x1F53D, 2}, {0x1F54B, 0x1F54E, 2},
+    {0x1F550, 0x1F567, 2}, {0x1F57A, 0x1F57A, 2}, {0x1F595, 0x1F596, 2}, {0x1F5A4, 0x1F5A4, 2},
+    {0x1F5FB, 0x1F64F, 2}, {0x1F680, 0x1F6C5, 2}, {0x1F6CC, 0x1F6CC, 2}, {0x1F6D0, 0x1F6D2, 2},
+    {0x1F6D5, 0x1F6D7, 2}, {0x1F6DC, 0x1F6DF, 2}, {0x1F6EB, 0x1F6EC, 2}, {0x1F6F4, 0x1F6FC, 2},
+    {0x1F7E0, 0x1F7EB, 2}, {0x1F7F0, 0x1F7F0, 2}, {0x1F90C, 0x1F93A, 2}, {0x1F93C, 0x1F945, 2},
+    {0x1F947, 0x1F9FF, 2}, {0x1FA70, 0x1FAFF, 2}, {0x20000, 0x2FFFD, 2}, {0x30000, 0x3FFFD, 2},
+    {0xE0100, 0xE01EF, 0},
+};
+
+#define WIDTH_RANGES_ENTRIES (sizeof(WIDTH_RANGES) / sizeof(WIDTH_RANGES[0]))
+
+/* Decodes the character at s, which has n bytes left, into *cp. Returns
+ * its length, or 1 with *cp set to -1 when s does not start a valid
+ * sequence: a stray continuation byte, an overlong form, a surrogate or a
+ * sequence cut short. */
+int utf8_decode(const char *s, int n, int *cp) {
+    const unsigned char *u = (const unsigned char *)s;
+    unsigned int c = u[0];
+    int len;
+    unsigned int min;
+
+    if (c < 0x80) {
+        *cp = c;
+        return 1;
+    }
+    if (c >= 0xC2 && c <= 0xDF) {
+        len = 2;
+        c &= 0x1F;
+        min = 0x80;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        len = 3;
+        c &= 0x0F;
+        min = 0x800;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        len = 4;
+        c &= 0x07;
+        min = 0x10000;
+    } else {
+        *cp = -1;
+        return 1;
+    }
+
+    if (len > n) {
+        *cp = -1;
+        return 1;
+    }
+    for (int j = 1; j < len; j++) {
+        if ((u[j] & 0xC0) != 0x80) {
+            *cp = -1;
+            return 1;
+        }
+        c = (c << 6) | (u[j] & 0x3F);
+    }
+    if (c < min || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF)) {
+        *cp = -1;
+        return 1;
+    }
+    *cp = c;
+    return len;
+}
+
+/* Width of every code point of each 256 code point page of the BMP where
+ * they all have the same, or 0 where they differ or it is not known yet. */
+unsigned char WIDTH_PAGES[256];
+
+int utf8_range_width(int cp) {
+    int lo = 0, hi = WIDTH_RANGES_ENTRIES - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if ((unsigned int)cp < WIDTH_RANGES[mid].first) hi = mid - 1;
+        else if ((unsigned int)cp > WIDTH_RANGES[mid].last) lo = mid + 1;
+        else return WIDTH_RANGES[mid].width;
+    }
+    return 1;
+}
+
+void utf8_init_width_pages() {
+    for (int page = 0; page < 256; page++) {
+        int width = utf8_range_width(page << 8);
+        for (int cp = (page << 8) + 1; cp < (page + 1) << 8 && width; cp++) {
+            if (utf8_range_width(cp) != width) width = 0;
+        }
+        WIDTH_PAGES[page] = width;
+    }
+}
+
+/* Returns the columns code point cp takes. Invalid bytes (cp == -1) and
+ * control characters are shown as a single symbol. Pages of one width,
+ * like those of CJK ideographs and Hangul, are answered without a search. */
+int utf8_width(int cp) {
+    if (cp < 0x300) return 1;
+    if (cp < 0x10000 && WIDTH_PAGES[cp >> 8]) return WIDTH_PAGES[cp >> 8];
+    return utf8_range_width(cp);
+}
+
+/* Returns where the character holding chars[at] starts: at itself, unless
+ * chars[at] continues a valid sequence that began before it. */
+int utf8_char_start(char *chars, int size, int at) {
+    if (at >= size || (chars[at] & 0xC0) != 0x80) return at;
+
+    for (int j = at - 1; j >= 0 && j >= at - 3; j--) {
+        if ((chars[j] & 0xC0) == 0x80) continue;
+        int cp;
+        int len = utf8_decode(&chars[j], size - j, &cp);
+        return (cp >= 0 && j + len > at) ? j : at;
+    }
+    return at;
+}
+
+/* Returns where the first character starting at or after chars[at] is. */
+int utf8_skip_tail(char *chars, int size, int at) {
+    int start = utf8_char_start(chars, size, at);
+    if (start == at) return at;
+
+    int cp;
+    return start + utf8_decode(&chars[start], size - start, &cp);
+}
+
 /* *** ROW OPERATIONS *** */
 
-int editor_row_cx_to_rx(erow *row, int cx) {
-    int rx = 0;
-    int j = 0;
-    for (j = 0; j < cx; j++) {
-        if (row->chars[j] == '\t')
-            rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-        rx++;
+/* Returns the column reached by rendering chars[from, to) starting at
+ * column rx. A character counts where it starts, so the range may end
+ * inside one and the bytes of one begun before from are skipped. */
+int editor_rx_advance(erow *row, int from, int to, int rx) {
+    char *chars = row->chars;
+    int j = utf8_skip_tail(chars, row->size, from);
+    while (j < to) {
+        unsigned char c = chars[j];
+        if (c < 0x80) {
+            if (c == '\t')
+                rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+            rx++;
+            j++;
+        } else {
+            int cp;
+            j += utf8_decode(&chars[j], row->size - j, &cp);
+            rx += utf8_width(cp);
+        }
     }
     return rx;
 }
 
-int editor_row_rx_to_cx(erow *row, int rx) {
-    int cur_rx = 0;
-    int cx;
-    for (cx = 0; cx < row->size; cx++) {
-        if (row->chars[cx] == '\t')
-            cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
-        cur_rx++;
+/* Returns the index of the chunk holding rendered column rx. */
+int editor_row_find_chunk_rx(erow *row, int rx) {
+    int lo = 0, hi = row->num_chunks - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (row->chunks[mid].rx <= rx) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+int editor_row_cx_to_rx(erow *row, int cx) {
+    if (row->special == 0) return cx;
 
-        if (cur_rx > rx) return cx;
+    if (row->chunks) {
+        row_chunk *chunk = &row->chunks[editor_row_find_chunk(row, cx)];
+        return editor_rx_advance(row, chunk->cx, cx, chunk->rx);
     }
-    return rx;
+    return editor_rx_advance(row, 0, cx, 0);
 }
 
-void editor_update_row(erow *row) {
-    int tabs = 0;
-    int j;
+/* Returns where the character after the one at cx starts. The zero-width
+ * marks drawn over a character are stepped over with it. */
+int editor_row_next_cx(erow *row, int cx) {
+    int cp;
+    cx += utf8_decode(&row->chars[cx], row->size - cx, &cp);
+    while (cx < row->size && (row->chars[cx] & 0x80)) {
+        int len = utf8_decode(&row->chars[cx], row->size - cx, &cp);
+        if (utf8_width(cp) != 0) break;
+        cx += len;
+    }
+    return cx;
+}
+
+/* Returns where the character before the one at cx starts, stepping back
+ * over zero-width marks to the character they are drawn over. */
+int editor_row_prev_cx(erow *row, int cx) {
+    while (cx > 0) {
+        int cp;
+        cx = utf8_char_start(row->chars, row->size, cx - 1);
+        utf8_decode(&row->chars[cx], row->size - cx, &cp);
+        if (utf8_width(cp) != 0) break;
+    }
+    return cx;
+}
+
+/* Counts the bytes of chars[from, to) that are not a column each: tabs and
+ * the bytes of non-ASCII characters. Text is handled eight bytes at a time:
+ * each byte of interest is marked with its high bit, and the marks are
+ * summed with a multiply. */
+int editor_count_special(char *chars, int from, int to) {
+    const unsigned long long ones = 0x0101010101010101ULL;
+    const unsigned long long lows = 0x7f7f7f7f7f7f7f7fULL;
+    int special = 0;
+    int j = from;
+    for (; j + 8 <= to; j += 8) {
+        unsigned long long w;
+        memcpy(&w, &chars[j], sizeof(w));
+        /* Tabs are the zero bytes of t, found exactly without carries. */
+        unsigned long long t = w ^ (ones * '\t');
+        unsigned long long tabs = ~(((t & lows) + lows) | t | lows);
+        unsigned long long marks = (w & ~lows) | tabs;
+        if (marks)
+            special += (int)(((marks >> 7) * ones) >> 56);
+    }
+    for (; j < to; j++)
+        special += (chars[j] == '\t' || (chars[j] & 0x80));
+    return special;
+}
+
+void editor_row_free_chunks(erow *row) {
+    for (int c = 0; c < row->num_chunks; c++)
+        free(row->chunks[c].hl.span);
+    free(row->chunks);
+    row->chunks = NULL;
+    row->num_chunks = 0;
+}
+
+void editor_row_free_fields(erow *row) {
+    free(row->fields);
+    row->fields = NULL;
+    row->num_fields = 0;
+}
+
+void editor_update_row_layout(erow *row) {
+    row->hash = 0;
+    editor_row_free_fields(row);
+    row->special = editor_count_special(row->chars, 0, row->size);
+
+    editor_row_free_chunks(row);
+    if (row->size <= KILO_CHUNK_SIZE) {
+        row->rsize = row->special ? editor_rx_advance(row, 0, row->size, 0) : row->size;
+        editor_wrap_update(row);
+        return;
+    }
+
+    row->num_chunks = (row->size + KILO_CHUNK_SIZE - 1) / KILO_CHUNK_SIZE;
+    row->chunks = calloc(row->num_chunks, sizeof(row_chunk));
+    for (int c = 0; c < row->num_chunks; c++)
+        row->chunks[c].cx = c * KILO_CHUNK_SIZE;
+
+    int rx = 0;
+    for (int c = 0; c < row->num_chunks; c++) {
+        row_chunk *chunk = &row->chunks[c];
+        int end = editor_row_chunk_end(row, c);
+        chunk->rx = rx;
+        chunk->special = editor_count_special(row->chars, chunk->cx, end);
+        editor_lex_init(&chunk->entry, 0);
+        rx = chunk->special ? editor_rx_advance(row, chunk->cx, end, rx) : rx + end - chunk->cx;
+    }
+    row->rsize = rx;
+    editor_wrap_update(row);
+}
+
+/* Chunk c starts at the right column, which moved by shift, and chunks up
+ * to edited changed inside. Recomputes the columns later chunks start at,
+ * walking a chunk only when its width may have changed. */
+void editor_row_chunks_reflow(erow *row, int c, int edited, int shift) {
+    if (row->special == 0) {
+        for (c = 0; c < row->num_chunks; c++)
+            row->chunks[c].rx = row->chunks[c].cx;
+        row->rsize = row->size;
+        return;
+    }
 
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t')
-            tabs++;
+    for (; c + 1 < row->num_chunks; c++) {
+        row_chunk *chunk = &row->chunks[c];
+        row_chunk *next = &row->chunks[c + 1];
+        int rx;
+        if (c > edited && (chunk->special == 0 || shift % KILO_TAB_STOP == 0)) {
+            if (shift == 0) return;
+            rx = next->rx + shift;
+        } else {
+            rx = editor_rx_advance(row, chunk->cx, next->cx, chunk->rx);
+        }
+        shift = rx - next->rx;
+        next->rx = rx;
     }
 
-    free(row->render);
-    row->render = malloc(row->size + tabs*(KILO_TAB_STOP - 1) + 1);
+    row_chunk *last = &row->chunks[row->num_chunks - 1];
+    row->rsize = editor_rx_advance(row, last->cx, row->size, last->rx);
+}
 
-    int idx = 0;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % KILO_TAB_STOP != 0)
-                row->render[idx++] = ' ';
+/* Updates a chunked row after delta bytes were inserted at at (delta > 0)
+ * or removed from there (delta < 0); chars and size already reflect the
+ * edit. Only the chunk holding the edit is re-rendered, and lexing restarts
+ * shortly before it and stops once a chunk is entered in the same state as
+ * before. */
+void editor_row_chunks_edit(erow *row, int at, int delta) {
+    row->hash = 0;
+    editor_row_free_fields(row);
+    int k = editor_row_find_chunk(row, at);
+    int c;
+    for (c = k + 1; c < row->num_chunks; c++)
+        row->chunks[c].cx += delta;
+
+    row_chunk *chunk = &row->chunks[k];
+    int size = editor_row_chunk_end(row, k) - chunk->cx;
+    int old_special = chunk->special;
+    int edited = k;
+
+    /* A character split between chunks is measured in the one it starts
+     * in, so an edit to the first bytes of a chunk can change the width of
+     * the chunk before, and one to its last bytes that of the chunk after. */
+    int first = (k > 0 && at - chunk->cx < 4 && row->chunks[k - 1].special) ? k - 1 : k;
+
+    if (size == 0 && row->num_chunks > 1) {
+        int rx = chunk->rx;
+        row->special -= old_special;
+        free(chunk->hl.span);
+        memmove(chunk, chunk + 1, sizeof(row_chunk) * (row->num_chunks - k - 1));
+        row->num_chunks--;
+        edited = k - 1;
+        if (k < row->num_chunks && (row->chars[row->chunks[k].cx] & 0xC0) == 0x80)
+            edited = k;
+        if (first < k) {
+            editor_row_chunks_reflow(row, first, edited, 0);
+        } else if (k < row->num_chunks) {
+            int shift = rx - row->chunks[k].rx;
+            row->chunks[k].rx = rx;
+            editor_row_chunks_reflow(row, k, edited, shift);
         } else {
-            row->render[idx++] = row->chars[j];
+            row->rsize = rx;
+        }
+    } else {
+        if (size > 2 * KILO_CHUNK_SIZE) {
+            row->chunks = realloc(row->chunks, sizeof(row_chunk) * (row->num_chunks + 1));
+            memmove(&row->chunks[k + 2], &row->chunks[k + 1],
+                    sizeof(row_chunk) * (row->num_chunks - k - 1));
+            row->num_chunks++;
+            row_chunk *half = &row->chunks[k + 1];
+            half->cx = row->chunks[k].cx + size / 2;
+            half->rx = 0;
+            half->hl.span = NULL;
+            half->hl.len = half->hl.cap = 0;
+            editor_lex_init(&half->entry, 0);
+            edited = k + 1;
+        }
+
+        int special = 0;
+        for (c = k; c <= edited; c++) {
+            row->chunks[c].special = editor_count_special(row->chars, row->chunks[c].cx,
+                                                          editor_row_chunk_end(row, c));
+            special += row->chunks[c].special;
         }
+        row->special += special - old_special;
+        if (edited + 1 < row->num_chunks && (row->chars[row->chunks[edited + 1].cx] & 0xC0) == 0x80)
+            edited++;
+        editor_row_chunks_reflow(row, first, edited, 0);
+    }
+    editor_wrap_update(row);
+
+    if (econf.syntax == NULL) return;
+
+    /* The lexer looks a few bytes ahead, so the chunks just before the
+     * edit may have seen the bytes that changed. */
+    int from = k;
+    while (from > 0 && at - row->chunks[from].cx < KILO_LEX_LOOKAHEAD)
+        from--;
+
+    struct lex_state st;
+    if (from == 0)
+        editor_lex_init(&st, row->idx > 0 && econf.row[row->idx - 1].hl_open_comment);
+    else
+        st = row->chunks[from].entry;
+
+    for (c = from; c < row->num_chunks; c++) {
+        row_chunk *ch = &row->chunks[c];
+        if (c > edited && editor_lex_state_equal(&st, &ch->entry))
+            return;
+        ch->entry = st;
+        ch->hl.len = 0;
+        editor_lex(econf.syntax, row->chars, row->size, ch->cx, editor_row_chunk_end(row, c),
+                   &st, &ch->hl, ch->cx);
     }
 
-    row->render[idx] = '\0';
-    row->rsize = idx;
+    if (row->hl_open_comment != st.in_comment) {
+        row->hl_open_comment = st.in_comment;
+        if (row->idx + 1 < econf.num_rows)
+            editor_update_syntax(&econf.row[row->idx + 1]);
+    }
+}
 
+void editor_update_row(erow *row) {
+    editor_update_row_layout(row);
     editor_update_syntax(row);
 }
 
+/* Sets up a new row at index at that takes ownership of chars, which must
+ * hold len bytes followed by a NUL. The row is not highlighted. */
+void editor_init_row(erow *row, int at, char *chars, int len) {
+    row->idx = at;
+    row->size = len;
+    row->chars = chars;
+    row->rsize = 0;
+    row->special = 0;
+    row->hl.span = NULL;
+    row->hl.len = 0;
+    row->hl.cap = 0;
+    row->chunks = NULL;
+    row->num_chunks = 0;
+    row->hl_open_comment = 0;
+    row->hl_pending = 0;
+    row->fields = NULL;
+    row->num_fields = 0;
+    editor_update_row_layout(row);
+}
+
 void editor_insert_row(int at, char *s, size_t len) {
     if (at < 0 || at > econf.num_rows) return;
 
     econf.row = realloc(econf.row, sizeof(erow) * (econf.num_rows + 1));
     memmove(&econf.row[at + 1], &econf.row[at], sizeof(erow) * (econf.num_rows - at));
     for (int j = at + 1; j <= econf.num_rows; j++) econf.row[j].idx++;
+    editor_wrap_insert(at, 1);
 
-    econf.row[at].idx = at;
-
-    econf.row[at].size = len;
-    econf.row[at].chars = malloc(len + 1);
-    memcpy(econf.row[at].chars, s, len);
-    econf.row[at].chars[len] = '\0';
-
-    econf.row[at].rsize = 0;
-    econf.row[at].render = NULL;
-    econf.row[at].hl = NULL;
-    econf.row[at].hl_open_comment = 0;
-    editor_update_row(&econf.row[at]);
+    char *chars = malloc(len + 1);
+    memcpy(chars, s, len);
+    chars[len] = '\0';
+    editor_init_row(&econf.row[at], at, chars, len);
+    editor_update_syntax(&econf.row[at]);
 
     econf.num_rows++;
     econf.dirty = 1;
+    econf.edits++;
+}
+
+/* Inserts n rows at index at in one go, taking ownership of the line
+ * buffers, and highlights them in a single pass. */
+void editor_insert_rows(int at, char **lines, int *lens, int n) {
+    if (n == 0 || at < 0 || at > econf.num_rows) return;
+
+    int entry = (at > 0 && econf.row[at - 1].hl_open_comment);
+    econf.row = realloc(econf.row, sizeof(erow) * (econf.num_rows + n));
+    memmove(&econf.row[at + n], &econf.row[at], sizeof(erow) * (econf.num_rows - at));
+    for (int j = at + n; j < econf.num_rows + n; j++) econf.row[j].idx += n;
+    editor_wrap_insert(at, n);
+    for (int j = 0; j < n; j++)
+        editor_init_row(&econf.row[at + j], at + j, lines[j], lens[j]);
+    econf.num_rows += n;
+
+    /* The row after the block was last lexed following row at - 1, so the
+     * pass below must compare against that state to know if it changed. */
+    econf.row[at + n - 1].hl_open_comment = entry;
+    editor_highlight_rows(at, at + n);
 }
 
 void editor_free_row(erow *row) {
-    free(row->render);
     free(row->chars);
-    free(row->hl);
+    free(row->hl.span);
+    editor_row_free_chunks(row);
+    editor_row_free_fields(row);
+}
+
+/* Deletes n rows starting at at with a single move of the rows after
+ * them, and fixes up the highlighting of the row that follows. */
+void editor_delete_rows(int at, int n) {
+    if (at < 0 || n <= 0 || at + n > econf.num_rows)
+        return;
+    for (int j = at; j < at + n; j++)
+        editor_free_row(&econf.row[j]);
+    memmove(&econf.row[at], &econf.row[at + n], sizeof(erow) * (econf.num_rows - at - n));
+    editor_wrap_delete(at, n);
+    econf.num_rows -= n;
+    for (int j = at; j < econf.num_rows; j++) econf.row[j].idx -= n;
+    editor_highlight_rows(at, at + 1 < econf.num_rows ? at + 1 : econf.num_rows);
+    econf.dirty = 1;
+    econf.edits++;
 }
 
 void editor_delete_row(int at) {
@@ -493,9 +1471,11 @@ void editor_delete_row(int at) {
         return;
     editor_free_row(&econf.row[at]);
     memmove(&econf.row[at], &econf.row[at + 1], sizeof(erow) * (econf.num_rows - at - 1));
+    editor_wrap_delete(at, 1);
     for (int j = at; j < econf.num_rows - 1; j++) econf.row[j].idx--;
     econf.num_rows--;
     econf.dirty = 1;
+    econf.edits++;
 }
 
 void editor_row_insert_char(erow *row, int at, int c) {
@@ -505,8 +1485,10 @@ void editor_row_insert_char(erow *row, int at, int c) {
     memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
     row->size++;
     row->chars[at] = c;
-    editor_update_row(row);
+    if (row->chunks && !row->hl_pending) editor_row_chunks_edit(row, at, 1);
+    else editor_update_row(row);
     econf.dirty = 1;
+    econf.edits++;
 }
 
 void editor_row_append_string(erow *row, char *s, size_t len) {
@@ -516,6 +1498,7 @@ void editor_row_append_string(erow *row, char *s, size_t len) {
     row->chars[row->size] = '\0';
     editor_update_row(row);
     econf.dirty = 1;
+    econf.edits++;
 }
 
 void editor_row_delete_char(erow *row, int at) {
@@ -523,8 +1506,10 @@ void editor_row_delete_char(erow *row, int at) {
         return;
     memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
     row->size--;
-    editor_update_row(row);
+    if (row->chunks && !row->hl_pending) editor_row_chunks_edit(row, at, -1);
+    else editor_update_row(row);
     econf.dirty = 1;
+    econf.edits++;
 }
 /* *** EDITOR OPERATIONS *** */
 
@@ -557,8 +1542,11 @@ void editor_delete_char() {
 
     erow *row = &econf.row[econf.cy];
     if (econf.cx > 0) {
-        editor_row_delete_char(row, econf.cx - 1);
-        econf.cx--;
+        int start = editor_row_prev_cx(row, econf.cx);
+        while (econf.cx > start) {
+            editor_row_delete_char(row, econf.cx - 1);
+            econf.cx--;
+        }
     } else {
         econf.cx = econf.row[econf.cy -1].size;
         editor_row_append_string(&econf.row[econf.cy - 1], row->chars, row->size);
@@ -567,32 +1555,443 @@ void editor_delete_char() {
     }
 }
 
-/* *** FILE I/O *** */
+/* The kill buffer holds whole lines. Cutting hands the rows' buffers over
+ * to it without copying; copying and pasting copy each line once. */
+void editor_kill_free() {
+    for (int j = 0; j < econf.kill_num; j++)
+        free(econf.kill_lines[j]);
+    free(econf.kill_lines);
+    free(econf.kill_lens);
+    econf.kill_lines = NULL;
+    econf.kill_lens = NULL;
+    econf.kill_num = 0;
+}
 
-void editor_open(char *filename) {
-    free(econf.filename);
-    econf.filename = strdup(filename);
+void editor_toggle_mark() {
+    if (econf.mark_row >= 0) {
+        econf.mark_row = -1;
+        editor_set_status_message("Mark cleared");
+    } else {
+        econf.mark_row = econf.cy;
+        editor_set_status_message("Mark set (Ctrl-X cut, Ctrl-C copy)");
+    }
+}
 
-    editor_select_syntax_highlight();
+/* Gets the lines between the mark and the cursor, or the cursor line
+ * when there is no mark. Returns 0 if there are none. */
+int editor_selection(int *from, int *to) {
+    int last = econf.num_rows - 1;
+    int a = econf.mark_row >= 0 ? econf.mark_row : econf.cy;
+    int b = econf.cy;
+    if (a > b) {
+        int t = a;
+        a = b;
+        b = t;
+    }
+    if (b > last) b = last;
+    if (a > b) return 0;
+    *from = a;
+    *to = b + 1;
+    return 1;
+}
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp)
-        die("fopen");
+void editor_copy(int cut) {
+    int from, to;
+    if (!editor_selection(&from, &to)) return;
+
+    int n = to - from;
+    editor_kill_free();
+    econf.kill_lines = malloc(sizeof(char *) * n);
+    econf.kill_lens = malloc(sizeof(int) * n);
+    econf.kill_num = n;
+    for (int j = 0; j < n; j++) {
+        erow *row = &econf.row[from + j];
+        econf.kill_lens[j] = row->size;
+        if (cut) {
+            econf.kill_lines[j] = row->chars;
+            row->chars = NULL;
+        } else {
+            econf.kill_lines[j] = malloc(row->size + 1);
+            memcpy(econf.kill_lines[j], row->chars, row->size + 1);
+        }
+    }
 
-    char *line = NULL;
-    size_t line_cap = 0;
-    ssize_t line_len = 13;
-    while ((line_len = getline(&line, &line_cap, fp)) != -1) {
-        while (line_len > 0 && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r'))
-            line_len--;
-        editor_insert_row(econf.num_rows, line, line_len);
+    if (cut) {
+        editor_delete_rows(from, n);
+        econf.cy = from;
+        econf.cx = 0;
     }
-    free(line);
-    fclose(fp);
-    econf.dirty = 0;
+    econf.mark_row = -1;
+    editor_set_status_message("%s %d line%s", cut ? "Cut" : "Copied", n, n == 1 ? "" : "s");
 }
 
-char *editor_rows_to_string(int *buflen) {
+void editor_paste() {
+    int n = econf.kill_num;
+    if (n == 0) return;
+
+    char **lines = malloc(sizeof(char *) * n);
+    int *lens = malloc(sizeof(int) * n);
+    for (int j = 0; j < n; j++) {
+        lens[j] = econf.kill_lens[j];
+        lines[j] = malloc(lens[j] + 1);
+        memcpy(lines[j], econf.kill_lines[j], lens[j] + 1);
+    }
+
+    int at = econf.cy < econf.num_rows ? econf.cy : econf.num_rows;
+    editor_insert_rows(at, lines, lens, n);
+    free(lines);
+    free(lens);
+
+    econf.dirty = 1;
+    econf.edits++;
+    econf.cy = at + n;
+    econf.cx = 0;
+    editor_set_status_message("Pasted %d line%s", n, n == 1 ? "" : "s");
+}
+
+/* *** FILE I/O *** */
+
+/* editor_open reads the first screenful itself and leaves the rest of the
+ * file to a loader thread. The thread hands over finished lines in batches
+ * and the main loop appends them as rows between keypresses, so only the
+ * main thread ever touches econf.row. */
+struct editor_loader {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    FILE *fp;
+    char **lines;
+    int *lens;
+    int num_lines;
+    int cap_lines;
+    int done;
+    int joined;
+};
+
+void editor_loader_publish(struct editor_loader *ld, char **lines, int *lens, int n) {
+    pthread_mutex_lock(&ld->lock);
+    if (ld->num_lines + n > ld->cap_lines) {
+        ld->cap_lines = (ld->num_lines + n) * 2;
+        ld->lines = realloc(ld->lines, sizeof(char *) * ld->cap_lines);
+        ld->lens = realloc(ld->lens, sizeof(int) * ld->cap_lines);
+    }
+    memcpy(&ld->lines[ld->num_lines], lines, sizeof(char *) * n);
+    memcpy(&ld->lens[ld->num_lines], lens, sizeof(int) * n);
+    ld->num_lines += n;
+    pthread_mutex_unlock(&ld->lock);
+}
+
+void *editor_loader_worker(void *arg) {
+    struct editor_loader *ld = arg;
+    char *lines[KILO_LOAD_BATCH];
+    int lens[KILO_LOAD_BATCH];
+    int n = 0;
+
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t line_len;
+    while ((line_len = getline(&line, &line_cap, ld->fp)) != -1) {
+        while (line_len > 0 && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r'))
+            line_len--;
+        lines[n] = malloc(line_len + 1);
+        memcpy(lines[n], line, line_len);
+        lines[n][line_len] = '\0';
+        lens[n++] = line_len;
+
+        if (n == KILO_LOAD_BATCH) {
+            editor_loader_publish(ld, lines, lens, n);
+            n = 0;
+        }
+    }
+    free(line);
+    editor_loader_publish(ld, lines, lens, n);
+
+    pthread_mutex_lock(&ld->lock);
+    ld->done = 1;
+    pthread_mutex_unlock(&ld->lock);
+    return NULL;
+}
+
+/* Appends up to KILO_LOAD_TICK_ROWS of the lines the loader has finished,
+ * so a fast loader cannot stall the UI. Returns 1 if the buffer changed or
+ * loading completed, and sets *more if finished lines are still waiting. */
+int editor_loader_poll(int *more) {
+    struct editor_loader *ld = econf.loader;
+    *more = 0;
+    if (ld == NULL) return 0;
+
+    pthread_mutex_lock(&ld->lock);
+    int n = ld->num_lines < KILO_LOAD_TICK_ROWS ? ld->num_lines : KILO_LOAD_TICK_ROWS;
+    char **lines = malloc(sizeof(char *) * (n + 1));
+    int *lens = malloc(sizeof(int) * (n + 1));
+    memcpy(lines, ld->lines, sizeof(char *) * n);
+    memcpy(lens, ld->lens, sizeof(int) * n);
+    ld->num_lines -= n;
+    memmove(ld->lines, &ld->lines[n], sizeof(char *) * ld->num_lines);
+    memmove(ld->lens, &ld->lens[n], sizeof(int) * ld->num_lines);
+    *more = ld->num_lines > 0;
+    int done = ld->done && !*more;
+    pthread_mutex_unlock(&ld->lock);
+
+    editor_insert_rows(econf.num_rows, lines, lens, n);
+    free(lines);
+    free(lens);
+
+    if (done) {
+        if (!ld->joined)
+            pthread_join(ld->thread, NULL);
+        econf.loaded_bytes = ftell(ld->fp);
+        fclose(ld->fp);
+        pthread_mutex_destroy(&ld->lock);
+        free(ld->lines);
+        free(ld->lens);
+        free(ld);
+        econf.loader = NULL;
+    }
+    return n > 0 || done;
+}
+
+/* Blocks until the whole file is loaded. */
+void editor_loader_finish() {
+    if (econf.loader == NULL) return;
+    pthread_join(econf.loader->thread, NULL);
+    econf.loader->joined = 1;
+
+    int more;
+    while (econf.loader)
+        editor_loader_poll(&more);
+}
+
+void editor_open(char *filename) {
+    free(econf.filename);
+    econf.filename = strdup(filename);
+    if (editor_session_load(filename))
+        return;
+
+    FILE *fp = fopen(filename, "r");
+    if (!fp)
+        die("fopen");
+
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t line_len = 13;
+    while (econf.num_rows < econf.screen_rows &&
+           (line_len = getline(&line, &line_cap, fp)) != -1) {
+        while (line_len > 0 && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r'))
+            line_len--;
+        editor_insert_row(econf.num_rows, line, line_len);
+    }
+    free(line);
+    econf.dirty = 0;
+
+    editor_select_syntax_highlight();
+
+    if (line_len == -1) {
+        econf.loaded_bytes = ftell(fp);
+        fclose(fp);
+        return;
+    }
+
+    struct editor_loader *ld = calloc(1, sizeof(struct editor_loader));
+    ld->fp = fp;
+    pthread_mutex_init(&ld->lock, NULL);
+    econf.loader = ld;
+    if (pthread_create(&ld->thread, NULL, editor_loader_worker, ld) != 0) {
+        editor_loader_worker(ld);
+        ld->joined = 1;
+        editor_loader_finish();
+    }
+}
+
+/* Follow mode watches the file with inotify and appends whatever is
+ * written to it past the bytes already in the buffer. A truncated file is
+ * read again from its start, and a file replaced under the same name, as
+ * log rotation does, is switched to once the old one is drained. */
+struct editor_follow {
+    int inotify_fd;
+    int watch;
+    int fd;
+    ino_t ino;
+    off_t offset;
+    int partial;    /* the last row is a line still being written */
+    int replaced;   /* the file was moved or deleted from under us */
+};
+
+int editor_follow_attach(struct editor_follow *fl) {
+    struct stat st;
+    int fd = open(econf.filename, O_RDONLY);
+    if (fd == -1) return -1;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    if (fl->watch != -1)
+        inotify_rm_watch(fl->inotify_fd, fl->watch);
+    fl->watch = inotify_add_watch(fl->inotify_fd, econf.filename,
+                                  IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+    if (fl->fd != -1)
+        close(fl->fd);
+    fl->fd = fd;
+    fl->ino = st.st_ino;
+    return 0;
+}
+
+void editor_follow_stop() {
+    struct editor_follow *fl = econf.follow;
+    if (fl == NULL) return;
+    if (fl->fd != -1)
+        close(fl->fd);
+    close(fl->inotify_fd);
+    free(fl);
+    econf.follow = NULL;
+}
+
+void editor_follow_start() {
+    if (econf.filename == NULL) {
+        editor_set_status_message("Follow needs a file");
+        return;
+    }
+    editor_loader_finish();
+
+    struct editor_follow *fl = malloc(sizeof(struct editor_follow));
+    fl->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    fl->watch = -1;
+    fl->fd = -1;
+    fl->offset = econf.loaded_bytes;
+    fl->partial = 0;
+    fl->replaced = 0;
+    econf.follow = fl;
+    if (fl->inotify_fd == -1 || editor_follow_attach(fl) == -1) {
+        editor_set_status_message("Can't follow! %s", strerror(errno));
+        editor_follow_stop();
+        return;
+    }
+
+    char last;
+    if (fl->offset > 0 && pread(fl->fd, &last, 1, fl->offset - 1) == 1)
+        fl->partial = (last != '\n');
+    editor_set_status_message("Following %s (Ctrl-T to stop)", econf.filename);
+}
+
+/* Turns bytes appended to the file into rows: the first line completes a
+ * partial last row, every other line becomes a new row, and all new rows are
+ * added and highlighted as one batch. */
+void editor_follow_append(char *buf, int len) {
+    char **lines = NULL;
+    int *lens = NULL;
+    int n = 0, cap = 0;
+    int dirty = econf.dirty;
+    int at = 0;
+
+    while (at < len) {
+        char *nl = memchr(&buf[at], '\n', len - at);
+        int end = nl ? nl - buf : len;
+        int line_len = end - at;
+        if (nl && line_len > 0 && buf[end - 1] == '\r')
+            line_len--;
+
+        if (econf.follow->partial && econf.num_rows > 0) {
+            /* Finishing a line changes a row that an undo record or a
+             * running filter may hold, so it counts as an edit. */
+            editor_row_append_string(&econf.row[econf.num_rows - 1], &buf[at], line_len);
+        } else {
+            if (n == cap) {
+                cap = cap ? cap * 2 : 64;
+                lines = realloc(lines, sizeof(char *) * cap);
+                lens = realloc(lens, sizeof(int) * cap);
+            }
+            lines[n] = malloc(line_len + 1);
+            memcpy(lines[n], &buf[at], line_len);
+            lines[n][line_len] = '\0';
+            lens[n++] = line_len;
+        }
+        econf.follow->partial = (nl == NULL);
+        at = end + 1;
+    }
+
+    editor_insert_rows(econf.num_rows, lines, lens, n);
+    free(lines);
+    free(lens);
+    econf.dirty = dirty;
+}
+
+/* Reads whatever was appended since the last poll. Returns 1 if the buffer
+ * changed. */
+int editor_follow_poll() {
+    struct editor_follow *fl = econf.follow;
+    if (fl == NULL) return 0;
+
+    char events[4096];
+    ssize_t len;
+    int woken = 0;
+    while ((len = read(fl->inotify_fd, events, sizeof(events))) > 0) {
+        ssize_t i = 0;
+        while (i < len) {
+            struct inotify_event ev;
+            memcpy(&ev, &events[i], sizeof(ev));
+            if (ev.mask & (IN_MOVE_SELF | IN_DELETE_SELF))
+                fl->replaced = 1;
+            i += sizeof(ev) + ev.len;
+        }
+        woken = 1;
+    }
+    /* Once the file is gone, keep checking for its replacement to appear. */
+    if (!woken && !fl->replaced) return 0;
+
+    int at_bottom = (econf.cy >= econf.num_rows - 1);
+    int old_rows = econf.num_rows;
+    int changed = 0;
+
+    while (1) {
+        struct stat st;
+        if (fstat(fl->fd, &st) == -1) break;
+
+        if (st.st_size < fl->offset) {
+            editor_set_status_message("%s: file truncated", econf.filename);
+            fl->offset = 0;
+            fl->partial = 0;
+        }
+
+        char buf[KILO_FOLLOW_READ];
+        ssize_t nread;
+        while ((nread = pread(fl->fd, buf, sizeof(buf), fl->offset)) > 0) {
+            editor_follow_append(buf, nread);
+            fl->offset += nread;
+            changed = 1;
+        }
+
+        struct stat path_st;
+        if (stat(econf.filename, &path_st) == -1) {
+            fl->replaced = 1;
+            break;
+        }
+        if (path_st.st_ino == fl->ino)
+            break;
+        if (editor_follow_attach(fl) == -1)
+            break;
+        editor_set_status_message("%s: file replaced, following new file", econf.filename);
+        fl->offset = 0;
+        fl->partial = 0;
+        fl->replaced = 0;
+    }
+
+    if (changed && at_bottom && econf.num_rows > old_rows) {
+        econf.cy = econf.num_rows - 1;
+        econf.cx = 0;
+    }
+    return changed;
+}
+
+void editor_follow_toggle() {
+    if (econf.follow) {
+        editor_follow_stop();
+        editor_set_status_message("Stopped following");
+    } else {
+        editor_follow_start();
+    }
+}
+
+char *editor_rows_to_string(int *buflen) {
     int total_len = 0;
     int j;
     for (j = 0; j < econf.num_rows; j++) {
@@ -609,112 +2008,1931 @@ char *editor_rows_to_string(int *buflen) {
         p++;
     }
 
-    return buf;
+    return buf;
+}
+
+void editor_save() {
+    editor_loader_finish();
+
+    if (econf.filename == NULL) {
+        econf.filename = editor_prompt("Save as: %s", NULL, 0);
+        if (econf.filename == NULL) {
+            editor_set_status_message("Save aborted");
+            return;
+        }
+        editor_select_syntax_highlight();
+    }
+
+    int len;
+    char *buf = editor_rows_to_string(&len);
+    int fd = open(econf.filename, O_RDWR | O_CREAT, 0644);
+    if (fd != -1) {
+        if (ftruncate(fd, len) != -1) {
+            if (write(fd, buf, len) == len) {
+                close(fd);
+                free(buf);
+                econf.dirty = 0;
+                econf.loaded_bytes = len;
+                if (econf.follow) {
+                    econf.follow->offset = len;
+                    econf.follow->partial = 0;
+                }
+                editor_set_status_message("%d bytes written to disk", len);
+                return;
+            }
+        }
+        close(fd);
+    }
+    free(buf);
+    editor_set_status_message("Can't save! I/O error: %s", strerror(errno));
+}
+
+/* *** FIND *** */
+
+void editor_find_callback(char *query, int key) {
+    static int last_match = -1;
+    static int direction = 1;
+
+    econf.match_row = -1;
+
+    if (key == '\r' || key == '\x1b') {
+        last_match = -1;
+        direction = 1;
+        return;
+    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+        direction = 1;
+    } else if (key == ARROW_LEFT || key == ARROW_UP) {
+        direction = -1;
+    } else {
+        last_match = -1;
+        direction = 1;
+    }
+
+    if (last_match == -1) direction = 1;
+    int current = last_match;
+    int i;
+    for (i = 0; i < econf.num_rows; i++) {
+        current += direction;
+        if (current == -1) current = econf.num_rows - 1;
+        else if (current == econf.num_rows) current = 0;
+
+        erow *row = &econf.row[current];
+        char *match = strstr(row->chars, query);
+        if (match) {
+            last_match = current;
+            econf.cy = current;
+            econf.cx = match - row->chars;
+            econf.row_off = econf.num_rows;
+
+            econf.match_row = current;
+            econf.match_start = match - row->chars;
+            econf.match_len = strlen(query);
+            break;
+        }
+    }
+}
+
+void editor_find() {
+    int saved_cx = econf.cx;
+    int saved_cy = econf.cy;
+    int saved_col_off = econf.col_off;
+    int saved_row_off = econf.row_off;
+
+    char *query = editor_prompt("Search: %s (Use ESC/Arrows/Enter)", editor_find_callback, 0);
+
+    if (query) {
+        free(query);
+    } else {
+        econf.cx = saved_cx;
+        econf.cy = saved_cy;
+        econf.col_off = saved_col_off;
+        econf.row_off = saved_row_off;
+    }
+}
+
+/* *** REPLACE *** */
+
+/* Bulk edits are undone as one step. The undo record holds the previous
+ * contents of every row the edit rewrote, in row order, and only stays
+ * valid until the next edit of any kind. */
+struct undo_row {
+    int idx;
+    int size;
+    char *chars;
+};
+
+struct editor_undo {
+    unsigned long edits;    /* econf.edits right after the bulk edit */
+    struct undo_row *rows;
+    int num_rows;
+    int cap_rows;
+};
+
+void editor_undo_free(struct editor_undo *undo) {
+    if (undo == NULL) return;
+    for (int j = 0; j < undo->num_rows; j++)
+        free(undo->rows[j].chars);
+    free(undo->rows);
+    free(undo);
+}
+
+/* Hands the contents of row idx over to undo and gives it chars instead. */
+void editor_undo_swap_row(struct editor_undo *undo, int idx, char *chars, int size) {
+    erow *row = &econf.row[idx];
+
+    if (undo->num_rows == undo->cap_rows) {
+        undo->cap_rows = undo->cap_rows ? undo->cap_rows * 2 : 64;
+        undo->rows = realloc(undo->rows, sizeof(struct undo_row) * undo->cap_rows);
+    }
+    struct undo_row *rec = &undo->rows[undo->num_rows++];
+    rec->idx = idx;
+    rec->size = row->size;
+    rec->chars = row->chars;
+
+    row->chars = chars;
+    row->size = size;
+    editor_update_row_layout(row);
+}
+
+/* Highlights the rows listed in undo, one pass per run of adjacent rows,
+ * once they all hold their new contents. */
+void editor_undo_highlight(struct editor_undo *undo) {
+    int j = 0;
+    while (j < undo->num_rows) {
+        int from = undo->rows[j].idx;
+        int to = from + 1;
+        for (j++; j < undo->num_rows && undo->rows[j].idx == to; j++)
+            to++;
+        editor_highlight_rows(from, to);
+    }
+}
+
+/* Leaves the cursor on a valid position after rows changed under it. */
+void editor_clamp_cursor() {
+    if (econf.cy < econf.num_rows && econf.cx > econf.row[econf.cy].size)
+        econf.cx = econf.row[econf.cy].size;
+}
+
+/* Replaces every occurrence of query with with. Each affected row is
+ * rebuilt once, and highlighting is redone only after all of them. */
+void editor_replace_all(char *query, char *with) {
+    editor_loader_finish();
+
+    int query_len = strlen(query);
+    int with_len = strlen(with);
+    struct editor_undo *undo = calloc(1, sizeof(struct editor_undo));
+    long count = 0;
+
+    for (int j = 0; j < econf.num_rows; j++) {
+        erow *row = &econf.row[j];
+        char *match = strstr(row->chars, query);
+        if (match == NULL) continue;
+
+        int n = 0;
+        for (char *m = match; m; m = strstr(m + query_len, query))
+            n++;
+
+        int size = row->size + n * (with_len - query_len);
+        char *chars = malloc(size + 1);
+        char *src = row->chars;
+        char *dst = chars;
+        for (char *m = match; m; m = strstr(src, query)) {
+            memcpy(dst, src, m - src);
+            dst += m - src;
+            memcpy(dst, with, with_len);
+            dst += with_len;
+            src = m + query_len;
+        }
+        memcpy(dst, src, row->chars + row->size - src);
+        chars[size] = '\0';
+
+        editor_undo_swap_row(undo, j, chars, size);
+        count += n;
+    }
+
+    if (count == 0) {
+        editor_undo_free(undo);
+        editor_set_status_message("No match for %s", query);
+        return;
+    }
+
+    editor_undo_highlight(undo);
+    editor_undo_free(econf.undo);
+    econf.dirty = 1;
+    econf.edits++;
+    undo->edits = econf.edits;
+    econf.undo = undo;
+    econf.match_row = -1;
+    editor_clamp_cursor();
+    editor_set_status_message("Replaced %ld occurrence%s in %d line%s (Ctrl-Z to undo)",
+                              count, count == 1 ? "" : "s",
+                              undo->num_rows, undo->num_rows == 1 ? "" : "s");
+}
+
+void editor_replace() {
+    char *query = editor_prompt("Replace: %s (ESC to cancel)", NULL, 0);
+    if (query == NULL) return;
+
+    char *with = editor_prompt("Replace with: %s (ESC to cancel)", NULL, 1);
+    if (with) {
+        editor_replace_all(query, with);
+        free(with);
+    }
+    free(query);
+}
+
+void editor_undo() {
+    struct editor_undo *undo = econf.undo;
+    econf.undo = NULL;
+    if (undo == NULL || undo->edits != econf.edits) {
+        editor_undo_free(undo);
+        editor_set_status_message("Nothing to undo");
+        return;
+    }
+
+    for (int j = 0; j < undo->num_rows; j++) {
+        struct undo_row *rec = &undo->rows[j];
+        erow *row = &econf.row[rec->idx];
+        char *chars = row->chars;
+        row->chars = rec->chars;
+        row->size = rec->size;
+        rec->chars = chars;
+        editor_update_row_layout(row);
+    }
+    editor_undo_highlight(undo);
+
+    econf.dirty = 1;
+    econf.edits++;
+    econf.match_row = -1;
+    editor_clamp_cursor();
+    editor_set_status_message("Undid changes to %d line%s", undo->num_rows,
+                              undo->num_rows == 1 ? "" : "s");
+    editor_undo_free(undo);
+}
+
+/* *** FILTER *** */
+
+/* A filter pipes rows [from, to) through a shell command. Rows are written
+ * to the child straight from row storage and its output is split into
+ * lines as it arrives, both without blocking, from the background tick.
+ * The rows are only replaced once the command exits successfully, and any
+ * edit made meanwhile cancels the filter. */
+struct editor_filter {
+    pid_t pid;
+    int in_fd;              /* child's stdin, or -1 once all rows are sent */
+    int out_fd;             /* child's stdout, or -1 at end of output */
+    int from, to;
+    int next_row;           /* next row to send */
+    int row_off;            /* bytes of it already sent, newline included */
+    unsigned long edits;
+    char **lines;
+    int *lens;
+    int num_lines;
+    int cap_lines;
+    char *partial;          /* output line still waiting for its newline */
+    int partial_len;
+};
+
+void editor_filter_free(struct editor_filter *fl) {
+    if (fl->in_fd != -1) close(fl->in_fd);
+    if (fl->out_fd != -1) close(fl->out_fd);
+    for (int j = 0; j < fl->num_lines; j++)
+        free(fl->lines[j]);
+    free(fl->lines);
+    free(fl->lens);
+    free(fl->partial);
+    free(fl);
+    econf.filter = NULL;
+}
+
+void editor_filter_cancel(const char *why) {
+    struct editor_filter *fl = econf.filter;
+    kill(fl->pid, SIGKILL);
+    waitpid(fl->pid, NULL, 0);
+    editor_filter_free(fl);
+    editor_set_status_message("Filter cancelled%s", why);
+}
+
+void editor_filter_add_line(struct editor_filter *fl, char *s, int len) {
+    if (fl->num_lines == fl->cap_lines) {
+        fl->cap_lines = fl->cap_lines ? fl->cap_lines * 2 : 256;
+        fl->lines = realloc(fl->lines, sizeof(char *) * fl->cap_lines);
+        fl->lens = realloc(fl->lens, sizeof(int) * fl->cap_lines);
+    }
+    if (len > 0 && s[len - 1] == '\r') len--;
+    char *line = malloc(len + 1);
+    memcpy(line, s, len);
+    line[len] = '\0';
+    fl->lines[fl->num_lines] = line;
+    fl->lens[fl->num_lines++] = len;
+}
+
+/* Sends rows to the child until its pipe is full. Returns 1 on progress. */
+int editor_filter_write(struct editor_filter *fl) {
+    int progress = 0;
+    while (fl->in_fd != -1) {
+        if (fl->next_row >= fl->to) {
+            close(fl->in_fd);
+            fl->in_fd = -1;
+            return 1;
+        }
+
+        struct iovec iov[KILO_FILTER_IOV];
+        int cnt = 0;
+        int off = fl->row_off;
+        for (int r = fl->next_row; r < fl->to && cnt + 2 <= KILO_FILTER_IOV; r++) {
+            erow *row = &econf.row[r];
+            if (off < row->size) {
+                iov[cnt].iov_base = &row->chars[off];
+                iov[cnt++].iov_len = row->size - off;
+            }
+            iov[cnt].iov_base = "\n";
+            iov[cnt++].iov_len = 1;
+            off = 0;
+        }
+
+        ssize_t n = writev(fl->in_fd, iov, cnt);
+        if (n == -1) {
+            if (errno == EAGAIN) break;
+            /* The command stopped reading; whatever it wrote still counts. */
+            close(fl->in_fd);
+            fl->in_fd = -1;
+            return 1;
+        }
+        progress = 1;
+        while (n > 0) {
+            int left = econf.row[fl->next_row].size + 1 - fl->row_off;
+            if (n < left) {
+                fl->row_off += n;
+                break;
+            }
+            n -= left;
+            fl->next_row++;
+            fl->row_off = 0;
+        }
+    }
+    return progress;
+}
+
+/* Reads what the child has written so far. Returns 1 on progress. */
+int editor_filter_read(struct editor_filter *fl) {
+    char buf[KILO_FILTER_READ];
+    int progress = 0;
+    for (int reads = 0; fl->out_fd != -1 && reads < 16; reads++) {
+        ssize_t n = read(fl->out_fd, buf, sizeof(buf));
+        if (n == -1 && errno == EAGAIN) break;
+        progress = 1;
+        if (n <= 0) {
+            if (fl->partial_len > 0)
+                editor_filter_add_line(fl, fl->partial, fl->partial_len);
+            fl->partial_len = 0;
+            close(fl->out_fd);
+            fl->out_fd = -1;
+            break;
+        }
+
+        int at = 0;
+        char *nl;
+        while ((nl = memchr(&buf[at], '\n', n - at)) != NULL) {
+            int len = nl - &buf[at];
+            if (fl->partial_len > 0) {
+                fl->partial = realloc(fl->partial, fl->partial_len + len);
+                memcpy(&fl->partial[fl->partial_len], &buf[at], len);
+                editor_filter_add_line(fl, fl->partial, fl->partial_len + len);
+                fl->partial_len = 0;
+            } else {
+                editor_filter_add_line(fl, &buf[at], len);
+            }
+            at += len + 1;
+        }
+        if (at < n) {
+            fl->partial = realloc(fl->partial, fl->partial_len + n - at);
+            memcpy(&fl->partial[fl->partial_len], &buf[at], n - at);
+            fl->partial_len += n - at;
+        }
+    }
+    return progress;
+}
+
+/* Waits until the filter's pipes or the keyboard are ready, for as long as
+ * reading a key would. Returns 1 if a key is waiting. */
+int editor_filter_wait() {
+    struct editor_filter *fl = econf.filter;
+    struct pollfd pfd[3] = {
+        { STDIN_FILENO, POLLIN, 0 },
+        { fl->in_fd, POLLOUT, 0 },
+        { fl->out_fd, POLLIN, 0 },
+    };
+    poll(pfd, 3, 100);
+    return (pfd[0].revents & POLLIN) != 0;
+}
+
+/* Moves the filter along. Returns 1 if anything happened, and sets *more
+ * if it may be able to go on right away. */
+int editor_filter_poll(int *more) {
+    struct editor_filter *fl = econf.filter;
+    *more = 0;
+    if (fl == NULL) return 0;
+
+    if (econf.edits != fl->edits) {
+        editor_filter_cancel(": the buffer was edited");
+        return 1;
+    }
+
+    int progress = editor_filter_write(fl);
+    progress |= editor_filter_read(fl);
+    *more = progress;
+
+    int status;
+    if (fl->in_fd != -1 || fl->out_fd != -1 || waitpid(fl->pid, &status, WNOHANG) == 0) {
+        editor_set_status_message("Filtering: sent %d of %d lines, got %d (Ctrl-P to cancel)",
+                                  fl->next_row - fl->from, fl->to - fl->from, fl->num_lines);
+        return progress;
+    }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        editor_filter_free(fl);
+        editor_set_status_message("Filter failed (%s %d), buffer left unchanged",
+                                  WIFEXITED(status) ? "exit status" : "signal",
+                                  WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status));
+        return 1;
+    }
+
+    int old_lines = fl->to - fl->from;
+    int new_lines = fl->num_lines;
+    editor_delete_rows(fl->from, old_lines);
+    editor_insert_rows(fl->from, fl->lines, fl->lens, new_lines);
+    fl->num_lines = 0;
+    econf.dirty = 1;
+    econf.edits++;
+    econf.cy = fl->from;
+    econf.cx = 0;
+    editor_filter_free(fl);
+    editor_set_status_message("Filtered %d lines into %d", old_lines, new_lines);
+    return 1;
+}
+
+/* Starts piping the selection, or the whole buffer when there is no mark,
+ * through command. */
+void editor_filter_start(char *command) {
+    editor_loader_finish();
+
+    int from = 0, to = econf.num_rows;
+    if (econf.mark_row >= 0) editor_selection(&from, &to);
+    econf.mark_row = -1;
+
+    int in[2], out[2];
+    if (pipe2(in, O_CLOEXEC) == -1) {
+        editor_set_status_message("Filter: %s", strerror(errno));
+        return;
+    }
+    if (pipe2(out, O_CLOEXEC) == -1) {
+        editor_set_status_message("Filter: %s", strerror(errno));
+        close(in[0]);
+        close(in[1]);
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd != -1) dup2(null_fd, STDERR_FILENO);
+        signal(SIGPIPE, SIG_DFL);
+        execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    if (pid == -1) {
+        editor_set_status_message("Filter: %s", strerror(errno));
+        close(in[1]);
+        close(out[0]);
+        return;
+    }
+
+    /* A command that exits early must not take the editor down with it. */
+    signal(SIGPIPE, SIG_IGN);
+    fcntl(in[1], F_SETFL, O_NONBLOCK);
+    fcntl(out[0], F_SETFL, O_NONBLOCK);
+
+    struct editor_filter *fl = calloc(1, sizeof(struct editor_filter));
+    fl->pid = pid;
+    fl->in_fd = in[1];
+    fl->out_fd = out[0];
+    fl->from = from;
+    fl->to = to;
+    fl->next_row = from;
+    fl->edits = econf.edits;
+    econf.filter = fl;
+}
+
+void editor_filter() {
+    if (econf.filter) {
+        editor_filter_cancel("");
+        return;
+    }
+
+    char *command = editor_prompt("Filter through: %s (ESC to cancel)", NULL, 0);
+    if (command == NULL) return;
+    editor_filter_start(command);
+    free(command);
+}
+
+/* *** DIFF *** */
+
+/* The diff view shows the buffer next to another file, with the lines that
+ * differ lined up side by side. Lines are compared by a hash that every row
+ * keeps until it is edited, using Myers' linear space algorithm: it looks
+ * for the middle snake of the edit graph from both ends and recurses on
+ * either side of it, so only two vectors of diagonals are needed. After an
+ * edit only the hunks around the rows that changed are compared again. */
+struct diff_line {
+    char *chars;
+    int size;
+};
+
+/* Rows [a, a + n) of the buffer stand for lines [b, b + m) of the file. */
+struct diff_hunk {
+    int a, n;
+    int b, m;
+    int line;               /* view line the hunk starts on */
+};
+
+struct editor_diff {
+    char *filename;
+    struct diff_line *lines;
+    unsigned long long *line_hash;
+    int num_lines;
+    unsigned long long *hash;   /* of the rows as last compared */
+    int num_hash;
+    struct diff_hunk *hunks;
+    int num_hunks;
+    int cap_hunks;
+    unsigned long edits;
+    int top;                /* view line at the top of the screen */
+};
+
+/* Working space for one comparison. vf and vb hold, for each diagonal,
+ * how far the forward and backward searches got. */
+struct diff_run {
+    unsigned long long *a, *b;
+    int *vf, *vb;
+    int max_d;
+    struct diff_hunk *hunks;
+    int num_hunks;
+    int cap_hunks;
+};
+
+unsigned long long editor_diff_hash(char *s, int len) {
+    unsigned long long h = 14695981039346656037ULL;
+    for (int j = 0; j < len; j++) {
+        h ^= (unsigned char)s[j];
+        h *= 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
+
+unsigned long long editor_row_hash(erow *row) {
+    if (row->hash == 0) row->hash = editor_diff_hash(row->chars, row->size);
+    return row->hash;
+}
+
+void editor_diff_add_hunk(struct diff_run *run, int a, int n, int b, int m) {
+    struct diff_hunk *last = run->num_hunks ? &run->hunks[run->num_hunks - 1] : NULL;
+    if (last && last->a + last->n == a && last->b + last->m == b) {
+        last->n += n;
+        last->m += m;
+        return;
+    }
+    if (run->num_hunks == run->cap_hunks) {
+        run->cap_hunks = run->cap_hunks ? run->cap_hunks * 2 : 16;
+        run->hunks = realloc(run->hunks, sizeof(struct diff_hunk) * run->cap_hunks);
+    }
+    struct diff_hunk *h = &run->hunks[run->num_hunks++];
+    h->a = a;
+    h->n = n;
+    h->b = b;
+    h->m = m;
+}
+
+/* Finds where an edit script of a[a0, a1) into b[b0, b1) can be split in
+ * two halves. Returns 0 if the script is longer than run->max_d allows. */
+int editor_diff_split(struct diff_run *run, int a0, int a1, int b0, int b1, int *sx, int *sy) {
+    unsigned long long *a = run->a, *b = run->b;
+    int n = a1 - a0, m = b1 - b0;
+    int delta = n - m, odd = delta & 1;
+    int max = (n + m + 1) / 2;
+    if (max > run->max_d) max = run->max_d;
+
+    int *vf = run->vf + run->max_d + 1;
+    int *vb = run->vb + run->max_d + 1;
+    vf[1] = 0;
+    vb[1] = 0;
+    for (int d = 0; d <= max; d++) {
+        for (int k = -d; k <= d; k += 2) {
+            int x = (k == -d || (k != d && vf[k - 1] < vf[k + 1])) ? vf[k + 1] : vf[k - 1] + 1;
+            int y = x - k;
+            while (x < n && y < m && a[a0 + x] == b[b0 + y]) x++, y++;
+            vf[k] = x;
+            if (odd && delta - k >= -(d - 1) && delta - k <= d - 1 && x + vb[delta - k] >= n) {
+                *sx = a0 + x;
+                *sy = b0 + y;
+                return 1;
+            }
+        }
+        for (int k = -d; k <= d; k += 2) {
+            int x = (k == -d || (k != d && vb[k - 1] < vb[k + 1])) ? vb[k + 1] : vb[k - 1] + 1;
+            int y = x - k;
+            while (x < n && y < m && a[a1 - 1 - x] == b[b1 - 1 - y]) x++, y++;
+            vb[k] = x;
+            if (!odd && delta - k >= -d && delta - k <= d && x + vf[delta - k] >= n) {
+                *sx = a1 - x;
+                *sy = b1 - y;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+void editor_diff_compare(struct diff_run *run, int a0, int a1, int b0, int b1) {
+    while (a0 < a1 && b0 < b1 && run->a[a0] == run->b[b0]) a0++, b0++;
+    while (a0 < a1 && b0 < b1 && run->a[a1 - 1] == run->b[b1 - 1]) a1--, b1--;
+
+    int x, y;
+    if (a0 == a1 || b0 == b1 || !editor_diff_split(run, a0, a1, b0, b1, &x, &y)) {
+        /* Past max_d the rest is given up on and shown as a single hunk. */
+        if (a0 < a1 || b0 < b1) editor_diff_add_hunk(run, a0, a1 - a0, b0, b1 - b0);
+        return;
+    }
+    editor_diff_compare(run, a0, x, b0, y);
+    editor_diff_compare(run, x, a1, y, b1);
+}
+
+/* Lays the hunks out on view lines, each taking as many as its longer side. */
+void editor_diff_layout(struct editor_diff *df) {
+    int line = 0, a = 0;
+    for (int j = 0; j < df->num_hunks; j++) {
+        struct diff_hunk *h = &df->hunks[j];
+        line += h->a - a;
+        h->line = line;
+        line += h->n > h->m ? h->n : h->m;
+        a = h->a + h->n;
+    }
+}
+
+/* Returns the index of the first hunk that ends after row, or would. */
+int editor_diff_find_hunk(int row) {
+    struct editor_diff *df = econf.diff;
+    int lo = 0, hi = df->num_hunks;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (df->hunks[mid].a + df->hunks[mid].n <= row) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Returns how far the file's line numbers run ahead of the rows' outside
+ * hunks, after the first n hunks. */
+int editor_diff_offset(int n) {
+    if (n == 0) return 0;
+    struct diff_hunk *h = &econf.diff->hunks[n - 1];
+    return h->b + h->m - (h->a + h->n);
+}
+
+/* Compares the rows again if the buffer changed since the last time. The
+ * rows that changed lie between the longest unchanged head and tail; only
+ * the hunks touching them are thrown away and that stretch recompared. */
+void editor_diff_update() {
+    struct editor_diff *df = econf.diff;
+    if (df->edits == econf.edits && df->num_hash == econf.num_rows) return;
+    df->edits = econf.edits;
+
+    int rows = econf.num_rows, old_rows = df->num_hash;
+    int head = 0, tail = 0;
+    while (head < rows && head < old_rows &&
+           editor_row_hash(&econf.row[head]) == df->hash[head])
+        head++;
+    while (tail < rows - head && tail < old_rows - head &&
+           editor_row_hash(&econf.row[rows - 1 - tail]) == df->hash[old_rows - 1 - tail])
+        tail++;
+    if (head == rows && head == old_rows) return;
+
+    if (rows > old_rows)
+        df->hash = realloc(df->hash, sizeof(unsigned long long) * rows);
+    if (tail)
+        memmove(&df->hash[rows - tail], &df->hash[old_rows - tail], sizeof(unsigned long long) * tail);
+    for (int j = head; j < rows - tail; j++)
+        df->hash[j] = editor_row_hash(&econf.row[j]);
+    df->num_hash = rows;
+
+    /* Widen [lo, hi) of the old rows to the hunks it touches, and find the
+     * file lines they stand for; outside hunks both sides run in step. */
+    int lo = head, hi = old_rows - tail;
+    int first = editor_diff_find_hunk(lo - 1);
+    int blo = lo + editor_diff_offset(first);
+    if (first < df->num_hunks && df->hunks[first].a <= lo) {
+        lo = df->hunks[first].a;
+        blo = df->hunks[first].b;
+    }
+    int last = first;
+    for (; last < df->num_hunks && df->hunks[last].a <= hi; last++) {
+        struct diff_hunk *h = &df->hunks[last];
+        if (h->a + h->n > hi) hi = h->a + h->n;
+    }
+    int bhi = hi + editor_diff_offset(last);
+    int shift = rows - old_rows;
+
+    struct diff_run run = { df->hash, df->line_hash, NULL, NULL, 0, NULL, 0, 0 };
+    int max = (hi + shift - lo + bhi - blo + 1) / 2;
+    run.max_d = max < KILO_DIFF_MAX_D ? max : KILO_DIFF_MAX_D;
+    run.vf = malloc(sizeof(int) * (2 * run.max_d + 3));
+    run.vb = malloc(sizeof(int) * (2 * run.max_d + 3));
+    editor_diff_compare(&run, lo, hi + shift, blo, bhi);
+    free(run.vf);
+    free(run.vb);
+
+    /* Splice the new hunks in place of [first, last). */
+    int kept = df->num_hunks - last;
+    int total = first + run.num_hunks + kept;
+    if (total > df->cap_hunks) {
+        df->cap_hunks = total;
+        df->hunks = realloc(df->hunks, sizeof(struct diff_hunk) * df->cap_hunks);
+    }
+    memmove(&df->hunks[first + run.num_hunks], &df->hunks[last], sizeof(struct diff_hunk) * kept);
+    if (run.num_hunks)
+        memcpy(&df->hunks[first], run.hunks, sizeof(struct diff_hunk) * run.num_hunks);
+    free(run.hunks);
+    df->num_hunks = total;
+    for (int j = first + run.num_hunks; j < total; j++) df->hunks[j].a += shift;
+    editor_diff_layout(df);
+}
+
+/* Returns the view line a row of the buffer is shown on. */
+int editor_diff_row_line(int row) {
+    int j = editor_diff_find_hunk(row);
+    if (j == 0) return row;
+    struct diff_hunk *h = &econf.diff->hunks[j - 1];
+    return h->line + (h->n > h->m ? h->n : h->m) + row - (h->a + h->n);
+}
+
+/* Finds what is shown on a view line: a row of the buffer and a line of
+ * the file, either -1 if there is none. Returns 1 inside a hunk. */
+int editor_diff_line(int line, int *row, int *file_line) {
+    struct editor_diff *df = econf.diff;
+    int lo = 0, hi = df->num_hunks;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (df->hunks[mid].line <= line) lo = mid + 1;
+        else hi = mid;
+    }
+
+    int in_hunk = 0;
+    if (lo == 0) {
+        *row = *file_line = line;
+    } else {
+        struct diff_hunk *h = &df->hunks[lo - 1];
+        int k = line - h->line;
+        int len = h->n > h->m ? h->n : h->m;
+        if (k < len) {
+            in_hunk = 1;
+            *row = k < h->n ? h->a + k : -1;
+            *file_line = k < h->m ? h->b + k : -1;
+        } else {
+            *row = h->a + h->n + k - len;
+            *file_line = h->b + h->m + k - len;
+        }
+    }
+    if (*row >= econf.num_rows) *row = -1;
+    if (*file_line >= df->num_lines) *file_line = -1;
+    return in_hunk;
+}
+
+/* Keeps the cursor row in view, scrolling by view lines so that filler
+ * lines facing the other side's hunks can be seen too. */
+void editor_diff_scroll() {
+    struct editor_diff *df = econf.diff;
+    editor_diff_update();
+
+    int line = editor_diff_row_line(econf.cy);
+    if (econf.cy < econf.row_off || line < df->top)
+        df->top = econf.cy == 0 ? 0 : line;
+    if (line >= df->top + econf.screen_rows)
+        df->top = line - econf.screen_rows + 1;
+
+    /* row_off becomes the first row shown at or below the top. */
+    int lo = 0, hi = econf.num_rows;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (editor_diff_row_line(mid) < df->top) lo = mid + 1;
+        else hi = mid;
+    }
+    econf.row_off = lo;
+}
+
+void editor_diff_free() {
+    struct editor_diff *df = econf.diff;
+    for (int j = 0; j < df->num_lines; j++)
+        free(df->lines[j].chars);
+    free(df->lines);
+    free(df->line_hash);
+    free(df->hash);
+    free(df->hunks);
+    free(df->filename);
+    free(df);
+    econf.diff = NULL;
+}
+
+void editor_diff_open(char *filename) {
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        editor_set_status_message("Can't open %s: %s", filename, strerror(errno));
+        return;
+    }
+    editor_loader_finish();
+
+    struct editor_diff *df = calloc(1, sizeof(struct editor_diff));
+    df->filename = strdup(filename);
+    int cap = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t line_len;
+    while ((line_len = getline(&line, &line_cap, fp)) != -1) {
+        while (line_len > 0 && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r'))
+            line_len--;
+        if (df->num_lines == cap) {
+            cap = cap ? cap * 2 : 1024;
+            df->lines = realloc(df->lines, sizeof(struct diff_line) * cap);
+            df->line_hash = realloc(df->line_hash, sizeof(unsigned long long) * cap);
+        }
+        struct diff_line *dl = &df->lines[df->num_lines++];
+        dl->chars = malloc(line_len + 1);
+        memcpy(dl->chars, line, line_len);
+        dl->chars[line_len] = '\0';
+        dl->size = line_len;
+        df->line_hash[df->num_lines - 1] = editor_diff_hash(dl->chars, line_len);
+    }
+    free(line);
+    fclose(fp);
+
+    /* Start out as if the buffer were empty, all of the file one hunk, and
+     * let the update compare everything. */
+    if (df->num_lines) {
+        df->hunks = malloc(sizeof(struct diff_hunk));
+        df->cap_hunks = df->num_hunks = 1;
+        df->hunks[0].a = df->hunks[0].n = df->hunks[0].b = 0;
+        df->hunks[0].m = df->num_lines;
+        df->hunks[0].line = 0;
+    }
+    df->edits = econf.edits - 1;
+    if (econf.wrap) editor_wrap_free();
+    if (econf.table) editor_table_free();
+    econf.diff = df;
+    editor_diff_update();
+    df->top = econf.row_off == 0 ? 0 : editor_diff_row_line(econf.row_off);
+    editor_set_status_message("%d differences with %s", df->num_hunks, filename);
+}
+
+void editor_diff() {
+    if (econf.diff) {
+        editor_diff_free();
+        editor_set_status_message("Diff closed");
+        return;
+    }
+
+    char *filename = editor_prompt("Diff against: %s (ESC to cancel)", NULL, 0);
+    if (filename == NULL) return;
+    editor_diff_open(filename);
+    free(filename);
+}
+
+/* *** SESSION *** */
+
+/* A session cache lets a large file be reopened quickly. It records where
+ * each line starts in the file, the multiline comment state each line
+ * leaves open, and where the cursor was. It is written on quit if the
+ * buffer still matches the file on disk, and is kept under the cache
+ * directory, named after a hash of the file's full path. A cache is used
+ * only while the file keeps the same size and modification time; one that
+ * does not match is deleted. On reopen the file is mapped and cut into rows
+ * at the recorded offsets. Each row's entry state is already known, so a
+ * row is lexed only when it is drawn or edited. */
+struct session_header {
+    char magic[8];
+    long long size;
+    long long mtime_sec;
+    long long mtime_nsec;
+    int num_rows;
+    int cx, cy;
+    int row_off, col_off;
+    int path_len;
+    char filetype[16];
+};
+
+/* Returns the cache file for the file at real, a full path, creating the
+ * cache directory first if create is set. */
+char *editor_session_path(char *real, int create) {
+    char *base = getenv("XDG_CACHE_HOME");
+    char *home = getenv("HOME");
+    char *dir;
+    if (base && *base) {
+        dir = malloc(strlen(base) + 8);
+        strcpy(dir, base);
+    } else if (home && *home) {
+        dir = malloc(strlen(home) + 16);
+        sprintf(dir, "%s/.cache", home);
+    } else {
+        return NULL;
+    }
+    if (create) mkdir(dir, 0700);
+    strcat(dir, "/kilo");
+    if (create) mkdir(dir, 0700);
+
+    char *path = malloc(strlen(dir) + 18);
+    sprintf(path, "%s/%016llx", dir, editor_diff_hash(real, strlen(real)));
+    free(dir);
+    return path;
+}
+
+void editor_session_header(struct session_header *h, struct stat *st) {
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, KILO_SESSION_MAGIC, sizeof(h->magic));
+    h->size = st->st_size;
+    h->mtime_sec = st->st_mtim.tv_sec;
+    h->mtime_nsec = st->st_mtim.tv_nsec;
+    if (econf.syntax)
+        snprintf(h->filetype, sizeof(h->filetype), "%s", econf.syntax->filetype);
+}
+
+/* Builds the rows from the cache for filename, if it has a valid one.
+ * Returns 1 if it did. */
+int editor_session_load(char *filename) {
+    char *real = realpath(filename, NULL);
+    if (real == NULL) return 0;
+    char *path = editor_session_path(real, 0);
+    int fd = path ? open(path, O_RDONLY) : -1;
+    if (fd == -1) {
+        free(real);
+        free(path);
+        return 0;
+    }
+
+    /* The filetype is part of the key: the states depend on the lexer. */
+    editor_select_syntax_highlight();
+
+    struct session_header h, want;
+    struct stat st;
+    long long *offsets = NULL;
+    unsigned char *states = NULL;
+    int path_len = strlen(real);
+    char *cached_path = malloc(path_len + 1);
+    int n = 0;
+    int ok = read(fd, &h, sizeof(h)) == sizeof(h) && stat(filename, &st) == 0;
+    if (ok) {
+        editor_session_header(&want, &st);
+        n = h.num_rows;
+        ok = !memcmp(h.magic, want.magic, sizeof(h.magic)) &&
+             h.size == want.size && h.mtime_sec == want.mtime_sec &&
+             h.mtime_nsec == want.mtime_nsec &&
+             !strncmp(h.filetype, want.filetype, sizeof(h.filetype)) &&
+             h.path_len == path_len && n >= 0 && n <= h.size &&
+             read(fd, cached_path, path_len) == path_len &&
+             !memcmp(cached_path, real, path_len);
+    }
+    if (ok) {
+        offsets = malloc(sizeof(long long) * (n + 1));
+        states = malloc(n + 1);
+        ok = read(fd, offsets, sizeof(long long) * n) == (ssize_t)(sizeof(long long) * n) &&
+             read(fd, states, n) == n;
+        offsets[n] = h.size;
+        for (int j = 0; ok && j < n; j++)
+            ok = offsets[j] < offsets[j + 1] && (j > 0 || offsets[0] == 0);
+    }
+    close(fd);
+
+    char *map = NULL;
+    int ffd = ok && h.size > 0 ? open(filename, O_RDONLY) : -1;
+    if (ffd != -1) {
+        map = mmap(NULL, h.size, PROT_READ, MAP_PRIVATE, ffd, 0);
+        if (map == MAP_FAILED) map = NULL;
+        close(ffd);
+    }
+    if (!ok || (h.size > 0 && map == NULL)) {
+        if (!ok) unlink(path);
+        free(offsets);
+        free(states);
+        free(cached_path);
+        free(real);
+        free(path);
+        return 0;
+    }
+
+    econf.row = malloc(sizeof(erow) * (n ? n : 1));
+    for (int j = 0; j < n; j++) {
+        char *line = &map[offsets[j]];
+        int len = offsets[j + 1] - offsets[j];
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            len--;
+        char *chars = malloc(len + 1);
+        memcpy(chars, line, len);
+        chars[len] = '\0';
+        editor_init_row(&econf.row[j], j, chars, len);
+        econf.row[j].hl_open_comment = states[j];
+        econf.row[j].hl_pending = econf.syntax != NULL;
+    }
+    econf.num_rows = n;
+    if (map) munmap(map, h.size);
+
+    econf.loaded_bytes = h.size;
+    econf.dirty = 0;
+    econf.cy = h.cy >= 0 && h.cy <= n ? h.cy : 0;
+    econf.cx = econf.cy < n && h.cx >= 0 && h.cx <= econf.row[econf.cy].size ? h.cx : 0;
+    econf.row_off = h.row_off >= 0 && h.row_off <= econf.cy ? h.row_off : econf.cy;
+    econf.col_off = h.col_off >= 0 ? h.col_off : 0;
+
+    free(offsets);
+    free(states);
+    free(cached_path);
+    free(real);
+    free(path);
+    return 1;
+}
+
+/* Writes the cache for the current file, if it is large enough to be worth
+ * it and the rows are exactly the lines of the file on disk. */
+void editor_session_save() {
+    if (econf.filename == NULL || econf.dirty || econf.loader ||
+        econf.num_rows < KILO_SESSION_MIN_ROWS)
+        return;
+
+    struct stat st;
+    int fd = open(econf.filename, O_RDONLY);
+    if (fd == -1) return;
+    char *map = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) map = NULL;
+    }
+    close(fd);
+    if (map == NULL) return;
+
+    /* Find where each line starts, checking it against its row. */
+    long long *offsets = malloc(sizeof(long long) * econf.num_rows);
+    unsigned char *states = malloc(econf.num_rows);
+    long long at = 0;
+    int n = 0;
+    while (at < st.st_size && n < econf.num_rows) {
+        char *nl = memchr(&map[at], '\n', st.st_size - at);
+        long long end = nl ? nl - map + 1 : st.st_size;
+        long long len = end - at;
+        while (len > 0 && (map[at + len - 1] == '\n' || map[at + len - 1] == '\r'))
+            len--;
+        erow *row = &econf.row[n];
+        if (len != row->size || memcmp(&map[at], row->chars, len)) break;
+        offsets[n] = at;
+        states[n++] = row->hl_open_comment;
+        at = end;
+    }
+    munmap(map, st.st_size);
+
+    char *real = realpath(econf.filename, NULL);
+    char *path = real && n == econf.num_rows && at == st.st_size ? editor_session_path(real, 1) : NULL;
+    char *tmp = path ? malloc(strlen(path) + 5) : NULL;
+    if (tmp) {
+        sprintf(tmp, "%s.tmp", path);
+        struct session_header h;
+        editor_session_header(&h, &st);
+        h.num_rows = n;
+        h.cx = econf.cx;
+        h.cy = econf.cy;
+        h.row_off = econf.row_off;
+        h.col_off = econf.col_off;
+        h.path_len = strlen(real);
+
+        FILE *fp = fopen(tmp, "w");
+        if (fp) {
+            int ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+                     fwrite(real, h.path_len, 1, fp) == 1 &&
+                     fwrite(offsets, sizeof(long long), n, fp) == (size_t)n &&
+                     fwrite(states, 1, n, fp) == (size_t)n;
+            if (fclose(fp) == 0 && ok) rename(tmp, path);
+            else unlink(tmp);
+        }
+    }
+    free(tmp);
+    free(path);
+    free(real);
+    free(offsets);
+    free(states);
+}
+
+/* *** SOFT WRAP *** */
+
+/* With soft wrap on, a row wider than the screen continues on the lines
+ * below it instead of scrolling sideways. The index keeps how many screen
+ * lines each row takes and a Fenwick tree of their prefix sums, so the
+ * line a row starts on and the row shown on a given line are both found
+ * in O(log n). A row whose width changes is a point update of the tree.
+ * Rows inserted or deleted only mark the tree stale from where they were,
+ * and it is rebuilt from there, in time linear in the rows after it, the
+ * next time it is used. */
+struct editor_wrap {
+    int width;              /* columns the rows are wrapped at */
+    int num_rows;
+    int cap;
+    int *lines;             /* screen lines of each row */
+    int *tree;              /* Fenwick tree over lines, 1-based */
+    int valid;              /* tree entries 1 to valid are up to date */
+    int top;                /* line at the top of the screen */
+    int row_off;            /* econf.row_off as last set from top */
+};
+
+/* Where a walk over the screen lines of a row stands: at chars[cx], which
+ * starts at column rx, on line line, which starts at column start. A tab
+ * may begin on an earlier line than the one it ends on, so rx <= start. */
+struct wrap_pos {
+    int cx, rx;
+    int line, start;
+};
+
+#define WRAP_POS_INIT { 0, 0, 0, 0 }
+
+/* Moves p over text that can be cut anywhere, up to column end, starting
+ * the lines it fills. Stops at the start of line sub, or on the line that
+ * holds column rx. Returns 1 if it stopped before end. */
+int editor_wrap_split(struct editor_wrap *wr, struct wrap_pos *p, int end, int sub, int rx) {
+    if (end <= p->start + wr->width) return 0;
+
+    int k = (end - p->start - 1) / wr->width;
+    int j = k;
+    if (sub - p->line < j) j = sub - p->line;
+    if ((rx - p->start) / wr->width < j) j = (rx - p->start) / wr->width;
+    if (j < 0) j = 0;
+    p->line += j;
+    p->start += j * wr->width;
+    return j < k;
+}
+
+/* Walks row from p until the start of line sub, or the line holding
+ * column rx, or its last line, whichever comes first. Lines are cut at
+ * the screen width, except before a wide character that would not fit,
+ * which starts the next line instead. Runs of plain ASCII, be they whole
+ * rows or chunks, are crossed in one step. */
+void editor_wrap_seek(struct editor_wrap *wr, erow *row, struct wrap_pos *p, int sub, int rx) {
+    int width = wr->width;
+    char *chars = row->chars;
+
+    while (p->line < sub && p->cx < row->size) {
+        int c = row->chunks ? editor_row_find_chunk(row, p->cx) : 0;
+        int special = row->chunks ? row->chunks[c].special : row->special;
+        if (special == 0) {
+            int end_cx = row->chunks ? editor_row_chunk_end(row, c) : row->size;
+            int end = p->rx + end_cx - p->cx;
+            if (editor_wrap_split(wr, p, end, sub, rx)) {
+                if (p->start > p->rx) {
+                    p->cx += p->start - p->rx;
+                    p->rx = p->start;
+                }
+                return;
+            }
+            p->cx = end_cx;
+            p->rx = end;
+            continue;
+        }
+
+        unsigned char ch = chars[p->cx];
+        int len = 1, cols = 1;
+        if (ch == '\t') {
+            cols = KILO_TAB_STOP - (p->rx % KILO_TAB_STOP);
+        } else if (ch >= 0x80) {
+            int cp;
+            len = utf8_decode(&chars[p->cx], row->size - p->cx, &cp);
+            cols = utf8_width(cp);
+        }
+
+        if (cols == 2 && width >= 2 && p->rx + 2 > p->start + width) {
+            if (p->rx > p->start) {
+                if (p->line >= sub || rx < p->rx) return;
+                p->line++;
+                p->start = p->rx;
+            }
+        } else if (editor_wrap_split(wr, p, p->rx + cols, sub, rx)) {
+            return;
+        }
+        p->cx += len;
+        p->rx += cols;
+    }
+}
+
+int editor_wrap_row_lines(struct editor_wrap *wr, erow *row) {
+    struct wrap_pos p = WRAP_POS_INIT;
+    editor_wrap_seek(wr, row, &p, INT_MAX, INT_MAX);
+    return p.line + 1;
+}
+
+void editor_wrap_reserve(struct editor_wrap *wr, int num_rows) {
+    if (num_rows <= wr->cap) return;
+    wr->cap = num_rows > 2 * wr->cap ? num_rows : 2 * wr->cap;
+    wr->lines = realloc(wr->lines, sizeof(int) * wr->cap);
+    wr->tree = realloc(wr->tree, sizeof(int) * (wr->cap + 1));
+}
+
+/* Brings the tree up to date. A node adds its row to the nodes for the
+ * power-of-two runs of rows just before it, which are rebuilt already. */
+void editor_wrap_sync(struct editor_wrap *wr) {
+    for (int i = wr->valid + 1; i <= wr->num_rows; i++) {
+        int sum = wr->lines[i - 1];
+        for (int k = 1; k < (i & -i); k <<= 1)
+            sum += wr->tree[i - k];
+        wr->tree[i] = sum;
+    }
+    wr->valid = wr->num_rows;
+}
+
+/* Returns the line row starts on. */
+int editor_wrap_row_line(struct editor_wrap *wr, int row) {
+    int line = 0;
+    for (int i = row; i > 0; i -= i & -i)
+        line += wr->tree[i];
+    return line;
+}
+
+/* Returns the row shown on line, num_rows past the end, and stores in
+ * *sub which of its lines that is. */
+int editor_wrap_line_row(struct editor_wrap *wr, int line, int *sub) {
+    int step = 1;
+    while (step * 2 <= wr->num_rows) step *= 2;
+
+    int row = 0;
+    for (; step > 0; step /= 2) {
+        if (row + step <= wr->num_rows && wr->tree[row + step] <= line) {
+            row += step;
+            line -= wr->tree[row];
+        }
+    }
+    *sub = line;
+    return row;
+}
+
+/* Recounts the lines of every row, for a new width. */
+void editor_wrap_rebuild(struct editor_wrap *wr) {
+    wr->width = editor_text_cols();
+    wr->num_rows = econf.num_rows;
+    editor_wrap_reserve(wr, wr->num_rows);
+    for (int j = 0; j < wr->num_rows; j++)
+        wr->lines[j] = editor_wrap_row_lines(wr, &econf.row[j]);
+    wr->valid = 0;
+}
+
+/* Called when the width of row may have changed. */
+void editor_wrap_update(erow *row) {
+    struct editor_wrap *wr = econf.wrap;
+    if (wr == NULL || row->idx >= wr->num_rows) return;
+
+    int lines = editor_wrap_row_lines(wr, row);
+    int delta = lines - wr->lines[row->idx];
+    if (delta == 0) return;
+    wr->lines[row->idx] = lines;
+    for (int i = row->idx + 1; i <= wr->valid; i += i & -i)
+        wr->tree[i] += delta;
+}
+
+/* Called when n rows were inserted at at, before they are set up. */
+void editor_wrap_insert(int at, int n) {
+    struct editor_wrap *wr = econf.wrap;
+    if (wr == NULL) return;
+
+    editor_wrap_reserve(wr, wr->num_rows + n);
+    memmove(&wr->lines[at + n], &wr->lines[at], sizeof(int) * (wr->num_rows - at));
+    for (int j = at; j < at + n; j++)
+        wr->lines[j] = 1;
+    wr->num_rows += n;
+    if (wr->valid > at) wr->valid = at;
+}
+
+/* Called when the n rows at at were deleted. */
+void editor_wrap_delete(int at, int n) {
+    struct editor_wrap *wr = econf.wrap;
+    if (wr == NULL) return;
+
+    memmove(&wr->lines[at], &wr->lines[at + n], sizeof(int) * (wr->num_rows - at - n));
+    wr->num_rows -= n;
+    if (wr->valid > at) wr->valid = at;
+}
+
+/* Returns which line of the cursor row the cursor is on, and stores in
+ * *start the column that line starts at. */
+int editor_wrap_cursor_sub(int *start) {
+    struct editor_wrap *wr = econf.wrap;
+    struct wrap_pos p = WRAP_POS_INIT;
+    if (econf.cy < wr->num_rows)
+        editor_wrap_seek(wr, &econf.row[econf.cy], &p, INT_MAX, econf.rx);
+    *start = p.start;
+    return p.line;
+}
+
+/* Keeps the cursor's line in view. Setting econf.row_off, as find and
+ * page up and down do, puts that row at the top. */
+void editor_wrap_scroll() {
+    struct editor_wrap *wr = econf.wrap;
+    if (wr->width != editor_text_cols()) editor_wrap_rebuild(wr);
+    editor_wrap_sync(wr);
+    econf.col_off = 0;
+
+    if (econf.row_off != wr->row_off)
+        wr->top = editor_wrap_row_line(wr, econf.row_off < wr->num_rows ? econf.row_off : econf.cy);
+    int start;
+    int line = editor_wrap_row_line(wr, econf.cy) + editor_wrap_cursor_sub(&start);
+    if (line < wr->top)
+        wr->top = line;
+    if (line >= wr->top + econf.screen_rows)
+        wr->top = line - econf.screen_rows + 1;
+
+    int sub;
+    econf.row_off = wr->row_off = editor_wrap_line_row(wr, wr->top, &sub);
+}
+
+void editor_wrap_draw_rows(cell *grid) {
+    struct editor_wrap *wr = econf.wrap;
+    int sub;
+    int row = editor_wrap_line_row(wr, wr->top, &sub);
+    const struct wrap_pos row_start = WRAP_POS_INIT;
+    struct wrap_pos p = row_start;
+    if (row < econf.num_rows)
+        editor_wrap_seek(wr, &econf.row[row], &p, sub, INT_MAX);
+
+    for (int y = 0; y < econf.screen_rows; y++) {
+        cell *line = &grid[y * econf.screen_cols];
+        if (row >= econf.num_rows) {
+            editor_draw_row(line, y);
+            continue;
+        }
+
+        /* The line ends where the next one starts. */
+        int from = p.start;
+        editor_wrap_seek(wr, &econf.row[row], &p, sub + 1, INT_MAX);
+        int to = p.line > sub ? p.start : from + wr->width;
+        editor_draw_text(line, &econf.row[row], from, to - from, HL_NORMAL);
+        if (++sub == wr->lines[row]) {
+            row++;
+            sub = 0;
+            p = row_start;
+        }
+    }
+}
+
+void editor_wrap_free() {
+    struct editor_wrap *wr = econf.wrap;
+    free(wr->lines);
+    free(wr->tree);
+    free(wr);
+    econf.wrap = NULL;
+}
+
+void editor_wrap_toggle() {
+    if (econf.wrap) {
+        editor_wrap_free();
+        editor_set_status_message("Soft wrap off");
+        return;
+    }
+    if (econf.diff) {
+        editor_set_status_message("Soft wrap is not available in the diff view");
+        return;
+    }
+    if (econf.table) {
+        editor_set_status_message("Soft wrap is not available in the table view");
+        return;
+    }
+
+    struct editor_wrap *wr = calloc(1, sizeof(struct editor_wrap));
+    econf.wrap = wr;
+    editor_wrap_rebuild(wr);
+    editor_wrap_sync(wr);
+    wr->top = editor_wrap_row_line(wr, econf.row_off < wr->num_rows ? econf.row_off : 0);
+    wr->row_off = econf.row_off;
+    editor_set_status_message("Soft wrap on");
+}
+
+/* *** TABLE VIEW *** */
+
+/* The table view lays CSV and TSV rows out in aligned columns. A row is
+ * split into fields only when it is drawn or the cursor is on it, and the
+ * split is kept on the row until its text changes. Column widths are the
+ * widest field seen so far, from the first KILO_TABLE_SAMPLE rows and the
+ * rows that have been on screen since, so no pass over the file is needed
+ * and columns only ever widen as more of it is seen. */
+struct editor_table {
+    char delim;
+    int num_cols;
+    int cap;
+    int *widths;            /* widest field seen in each column, capped */
+    int *x;                 /* column each table column starts at */
+};
+
+/* Splits row at the delimiters outside double quotes. */
+void editor_table_row_fields(struct editor_table *tb, erow *row) {
+    if (row->fields) return;
+
+    int cap = 8;
+    row->fields = malloc(sizeof(int) * cap);
+    row->fields[0] = 0;
+    row->num_fields = 1;
+    int quoted = 0;
+    for (int j = 0; j < row->size; j++) {
+        char c = row->chars[j];
+        if (c == '"') {
+            quoted = !quoted;
+        } else if (c == tb->delim && !quoted) {
+            if (row->num_fields == cap) {
+                cap *= 2;
+                row->fields = realloc(row->fields, sizeof(int) * cap);
+            }
+            row->fields[row->num_fields++] = j + 1;
+        }
+    }
+}
+
+/* Returns where field k of row ends, before the delimiter after it. */
+int editor_table_field_end(erow *row, int k) {
+    return k + 1 < row->num_fields ? row->fields[k + 1] - 1 : row->size;
+}
+
+/* Returns the columns chars[from, to) of row take. */
+int editor_table_text_width(erow *row, int from, int to) {
+    return row->special ? editor_rx_advance(row, from, to, 0) : to - from;
+}
+
+/* Widens the columns to fit the fields of row. */
+void editor_table_measure(struct editor_table *tb, erow *row) {
+    editor_table_row_fields(tb, row);
+    int changed = 0;
+    if (row->num_fields > tb->cap) {
+        tb->cap = row->num_fields > 2 * tb->cap ? row->num_fields : 2 * tb->cap;
+        tb->widths = realloc(tb->widths, sizeof(int) * tb->cap);
+        tb->x = realloc(tb->x, sizeof(int) * (tb->cap + 1));
+    }
+    while (tb->num_cols < row->num_fields) {
+        tb->widths[tb->num_cols++] = 1;
+        changed = 1;
+    }
+
+    for (int k = 0; k < row->num_fields; k++) {
+        if (tb->widths[k] == KILO_TABLE_COL_MAX) continue;
+        int w = editor_table_text_width(row, row->fields[k], editor_table_field_end(row, k));
+        if (w > KILO_TABLE_COL_MAX) w = KILO_TABLE_COL_MAX;
+        if (w > tb->widths[k]) {
+            tb->widths[k] = w;
+            changed = 1;
+        }
+    }
+
+    /* Columns are set apart by " | ". */
+    if (changed) {
+        tb->x[0] = 0;
+        for (int k = 0; k < tb->num_cols; k++)
+            tb->x[k + 1] = tb->x[k] + tb->widths[k] + 3;
+    }
+}
+
+/* Returns the column of the table view cx of row is drawn at. A delimiter
+ * is drawn as the separator after its column, and text cut off at the
+ * column's width puts the cursor on the column's last cell. */
+int editor_table_cx_to_rx(struct editor_table *tb, erow *row, int cx) {
+    int lo = 0, hi = row->num_fields - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (row->fields[mid] <= cx) lo = mid;
+        else hi = mid - 1;
+    }
+
+    int end = editor_table_field_end(row, lo);
+    if (cx == end && lo + 1 < row->num_fields)
+        return tb->x[lo] + tb->widths[lo] + 1;
+    int w = editor_table_text_width(row, row->fields[lo], cx);
+    int max = cx < end ? tb->widths[lo] - 1 : tb->widths[lo];
+    return tb->x[lo] + (w < max ? w : max);
+}
+
+/* Measures the rows on screen and puts the cursor's column in econf.rx. */
+void editor_table_scroll() {
+    struct editor_table *tb = econf.table;
+    for (int y = 0; y < econf.screen_rows && econf.row_off + y < econf.num_rows; y++)
+        editor_table_measure(tb, &econf.row[econf.row_off + y]);
+    if (econf.cy < econf.num_rows)
+        econf.rx = editor_table_cx_to_rx(tb, &econf.row[econf.cy], econf.cx);
+}
+
+void editor_table_draw_row(cell *line, erow *row) {
+    struct editor_table *tb = econf.table;
+    if (row->hl_pending) editor_update_syntax(row);
+    editor_table_row_fields(tb, row);
+
+    int cols = econf.screen_cols;
+    int selected = editor_row_selected(row);
+    int sep_color = editor_syntax_to_color(HL_COMMENT) | selected;
+    for (int k = 0; k < row->num_fields && k < tb->num_cols; k++) {
+        int x = tb->x[k] - econf.col_off;
+        if (x >= cols) break;
+        int from = x > 0 ? x : 0;
+        int to = x + tb->widths[k] < cols ? x + tb->widths[k] : cols;
+        if (to > from)
+            editor_draw_chars(&line[from], to - from, row->chars, editor_table_field_end(row, k),
+                              row->fields[k], 0, from - x, row, selected);
+
+        x += tb->widths[k] + 1;
+        if (k + 1 < row->num_fields && x >= 0 && x < cols)
+            editor_draw_chars(&line[x], 1, "|", 1, 0, 0, 0, NULL, sep_color);
+    }
+}
+
+void editor_table_draw_rows(cell *grid) {
+    for (int y = 0; y < econf.screen_rows; y++) {
+        cell *line = &grid[y * econf.screen_cols];
+        if (econf.row_off + y < econf.num_rows)
+            editor_table_draw_row(line, &econf.row[econf.row_off + y]);
+        else
+            editor_draw_row(line, y);
+    }
+}
+
+/* Picks whichever of the usual delimiters the first row has most of. */
+char editor_table_guess_delim() {
+    const char *delims = ",\t;|";
+    char best = ',';
+    int best_count = 0;
+    for (const char *d = delims; *d; d++) {
+        int count = 0;
+        for (int j = 0; econf.num_rows > 0 && j < econf.row[0].size; j++)
+            if (econf.row[0].chars[j] == *d) count++;
+        if (count > best_count) {
+            best = *d;
+            best_count = count;
+        }
+    }
+    return best;
+}
+
+void editor_table_free() {
+    for (int j = 0; j < econf.num_rows; j++)
+        editor_row_free_fields(&econf.row[j]);
+    free(econf.table->widths);
+    free(econf.table->x);
+    free(econf.table);
+    econf.table = NULL;
+}
+
+void editor_table_toggle() {
+    if (econf.table) {
+        editor_table_free();
+        econf.col_off = 0;
+        editor_set_status_message("Table view off");
+        return;
+    }
+    if (econf.diff) {
+        editor_set_status_message("Table view is not available in the diff view");
+        return;
+    }
+    if (econf.wrap) editor_wrap_free();
+
+    struct editor_table *tb = calloc(1, sizeof(struct editor_table));
+    tb->delim = editor_table_guess_delim();
+    tb->x = malloc(sizeof(int));
+    tb->x[0] = 0;
+    econf.table = tb;
+    for (int j = 0; j < econf.num_rows && j < KILO_TABLE_SAMPLE; j++)
+        editor_table_measure(tb, &econf.row[j]);
+    econf.col_off = 0;
+    if (tb->delim == '\t')
+        editor_set_status_message("Table view on, fields split at tabs");
+    else
+        editor_set_status_message("Table view on, fields split at '%c'", tb->delim);
+}
+
+/* *** BUFFERS *** */
+
+/* Several files can be open at once. econf always holds the current
+ * buffer; the others keep a copy of their part of it, and the terminal,
+ * frame, output statistics and kill buffer stay with econf across
+ * switches. Background buffers are paused: their loader, follow and
+ * filter carry on once they are current again.
+ *
+ * All buffers share one memory budget. When it is exceeded, the least
+ * recently used background buffers first lose what can be recomputed
+ * from their text: highlighting, which is lexed again a row at a time as
+ * rows are drawn, table fields and the soft wrap index. If that is not
+ * enough, buffers that still match their file give up their text too,
+ * after writing their session cache, so switching back maps the file and
+ * cuts it into rows instead of reading and lexing it all again. */
+struct editor_buffer {
+    struct editor_config conf;
+    unsigned long used;     /* econf.buffer_clock when it was last left */
+    size_t text_bytes;
+    size_t derived_bytes;
+    int dropped;            /* text freed, to be read back from the file */
+    off_t file_size;        /* the file as it was when dropped */
+    time_t file_mtime;
+    int reloaded;           /* read back, and still unedited if econf.edits is reload_edits */
+    unsigned long reload_edits;
+};
+
+/* Resets the buffer part of econf to an empty buffer. */
+void editor_init_buffer() {
+    econf.cx = 0;
+    econf.cy = 0;
+    econf.rx = 0;
+    econf.row_off = 0;
+    econf.col_off = 0;
+    econf.num_rows = 0;
+    econf.row = NULL;
+    econf.dirty = 0;
+    econf.edits = 0;
+    econf.filename = NULL;
+    econf.syntax = NULL;
+    econf.loader = NULL;
+    econf.loaded_bytes = 0;
+    econf.follow = NULL;
+    econf.undo = NULL;
+    econf.filter = NULL;
+    econf.diff = NULL;
+    econf.wrap = NULL;
+    econf.table = NULL;
+    econf.mark_row = -1;
+    econf.match_row = -1;
+}
+
+/* Stores the current buffer and makes buffer i current, keeping
+ * everything that belongs to the terminal rather than to a buffer. */
+void editor_buffer_swap(int i) {
+    struct editor_config term = econf;
+    econf.buffers[econf.cur_buffer].conf = econf;
+    econf = term.buffers[i].conf;
+
+    econf.screen_rows = term.screen_rows;
+    econf.screen_cols = term.screen_cols;
+    memcpy(econf.status_msg, term.status_msg, sizeof(econf.status_msg));
+    econf.status_msg_time = term.status_msg_time;
+    econf.frame = term.frame;
+    econf.frame_row_off = term.frame_row_off;
+    econf.term_x = term.term_x;
+    econf.term_y = term.term_y;
+    econf.term_attr = term.term_attr;
+    econf.out_frames = term.out_frames;
+    econf.out_bytes = term.out_bytes;
+    econf.out_full_bytes = term.out_full_bytes;
+    econf.frame_time = term.frame_time;
+    econf.frame_interval = term.frame_interval;
+    econf.redraw_pending = term.redraw_pending;
+    econf.kill_lines = term.kill_lines;
+    econf.kill_lens = term.kill_lens;
+    econf.kill_num = term.kill_num;
+    econf.buffers = term.buffers;
+    econf.num_buffers = term.num_buffers;
+    econf.buffer_clock = term.buffer_clock;
+    econf.mem_budget = term.mem_budget;
+    econf.original_termios = term.original_termios;
+    econf.cur_buffer = i;
+}
+
+/* Counts the bytes the rows of c take, and how many of them go to data
+ * that can be recomputed from the text. */
+void editor_buffer_usage(struct editor_config *c, size_t *text, size_t *derived) {
+    size_t t = sizeof(erow) * c->num_rows, d = 0;
+    for (int j = 0; j < c->num_rows; j++) {
+        erow *row = &c->row[j];
+        t += row->size + 1 + sizeof(row_chunk) * row->num_chunks;
+        d += sizeof(hl_span) * row->hl.cap + sizeof(int) * row->num_fields;
+        for (int k = 0; k < row->num_chunks; k++)
+            d += sizeof(hl_span) * row->chunks[k].hl.cap;
+    }
+    if (c->wrap) d += sizeof(int) * 2 * c->wrap->cap;
+    *text = t;
+    *derived = d;
+}
+
+/* Frees the highlighting, table fields and wrap index of background
+ * buffer b. Rows are lexed again from their kept entry states when they
+ * are next drawn. */
+void editor_buffer_drop_derived(struct editor_buffer *b) {
+    struct editor_config *c = &b->conf;
+    for (int j = 0; j < c->num_rows; j++) {
+        erow *row = &c->row[j];
+        free(row->hl.span);
+        row->hl.span = NULL;
+        row->hl.len = row->hl.cap = 0;
+        for (int k = 0; k < row->num_chunks; k++) {
+            free(row->chunks[k].hl.span);
+            row->chunks[k].hl.span = NULL;
+            row->chunks[k].hl.len = row->chunks[k].hl.cap = 0;
+        }
+        row->hl_pending = c->syntax != NULL;
+        editor_row_free_fields(row);
+    }
+    if (c->wrap) {
+        free(c->wrap->lines);
+        free(c->wrap->tree);
+        c->wrap->lines = c->wrap->tree = NULL;
+        c->wrap->num_rows = c->wrap->cap = c->wrap->valid = 0;
+    }
+    b->derived_bytes = 0;
+}
+
+/* Returns 1 if the text of background buffer b is exactly its file and
+ * nothing else refers to it, so it can be read back later. */
+int editor_buffer_droppable(struct editor_buffer *b) {
+    struct editor_config *c = &b->conf;
+    return !b->dropped && c->filename && !c->dirty && !c->loader && !c->follow &&
+           !c->filter && !c->diff && !c->undo && c->num_rows > 0;
+}
+
+/* Frees the rows of background buffer i, saving its session cache first. */
+void editor_buffer_drop_text(int i) {
+    int cur = econf.cur_buffer;
+    editor_buffer_swap(i);
+    struct editor_buffer *b = &econf.buffers[i];
+    /* A buffer read back and left unedited has a session cache already. */
+    if (!b->reloaded || econf.edits != b->reload_edits)
+        editor_session_save();
+
+    struct stat st;
+    if (stat(econf.filename, &st) == 0) {
+        b->file_size = st.st_size;
+        b->file_mtime = st.st_mtime;
+    } else {
+        b->file_size = -1;
+        b->file_mtime = 0;
+    }
+    for (int j = 0; j < econf.num_rows; j++)
+        editor_free_row(&econf.row[j]);
+    free(econf.row);
+    econf.row = NULL;
+    econf.num_rows = 0;
+    if (econf.wrap) econf.wrap->num_rows = econf.wrap->valid = 0;
+
+    editor_buffer_swap(cur);
+    b->dropped = 1;
+    b->text_bytes = b->derived_bytes = 0;
 }
 
-void editor_save() {
-    if (econf.filename == NULL) {
-        econf.filename = editor_prompt("Save as: %s", NULL);
-        if (econf.filename == NULL) {
-            editor_set_status_message("Save aborted");
-            return;
-        }
-        editor_select_syntax_highlight();
+/* Returns the least recently used background buffer that want accepts,
+ * or -1. */
+int editor_buffer_lru(int (*want)(struct editor_buffer *)) {
+    int best = -1;
+    for (int i = 0; i < econf.num_buffers; i++) {
+        struct editor_buffer *b = &econf.buffers[i];
+        if (i == econf.cur_buffer || !want(b)) continue;
+        if (best == -1 || b->used < econf.buffers[best].used) best = i;
     }
+    return best;
+}
 
-    int len;
-    char *buf = editor_rows_to_string(&len);
-    int fd = open(econf.filename, O_RDWR | O_CREAT, 0644);
-    if (fd != -1) {
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                econf.dirty = 0;
-                editor_set_status_message("%d bytes written to disk", len);
-                return;
-            }
+int editor_buffer_has_derived(struct editor_buffer *b) {
+    return b->derived_bytes > 0;
+}
+
+/* Trims background buffers until all buffers fit the memory budget. */
+void editor_buffers_trim() {
+    size_t text, derived;
+    editor_buffer_usage(&econf, &text, &derived);
+    size_t total = text + derived;
+    for (int i = 0; i < econf.num_buffers; i++)
+        if (i != econf.cur_buffer)
+            total += econf.buffers[i].text_bytes + econf.buffers[i].derived_bytes;
+
+    while (total > econf.mem_budget) {
+        int i = editor_buffer_lru(editor_buffer_has_derived);
+        if (i != -1) {
+            total -= econf.buffers[i].derived_bytes;
+            editor_buffer_drop_derived(&econf.buffers[i]);
+            continue;
         }
-        close(fd);
+        i = editor_buffer_lru(editor_buffer_droppable);
+        if (i == -1) break;
+        total -= econf.buffers[i].text_bytes;
+        editor_buffer_drop_text(i);
     }
-    free(buf);
-    editor_set_status_message("Can't save! I/O error: %s", strerror(errno));
 }
 
-/* *** FIND *** */
+/* Reads the rows of the current buffer back from its file, where the
+ * cursor was when they were dropped. */
+void editor_buffer_reload(struct editor_buffer *b) {
+    int cx = econf.cx, cy = econf.cy, row_off = econf.row_off, col_off = econf.col_off;
+    struct stat st;
+    b->dropped = 0;
+    if (stat(econf.filename, &st) == -1 || access(econf.filename, R_OK) == -1) {
+        editor_set_status_message("Can't read %s back: %s", econf.filename, strerror(errno));
+        econf.cx = econf.cy = econf.row_off = econf.col_off = 0;
+        return;
+    }
 
-void editor_find_callback(char *query, int key) {
-    static int last_match = -1;
-    static int direction = 1;
+    /* editor_open replaces econf.filename with a copy of its argument. */
+    char *filename = econf.filename;
+    econf.filename = NULL;
+    editor_open(filename);
+    free(filename);
+    if (econf.loader && cy >= econf.num_rows)
+        editor_loader_finish();
+    econf.cy = cy <= econf.num_rows ? cy : econf.num_rows;
+    econf.cx = econf.cy < econf.num_rows && cx <= econf.row[econf.cy].size ? cx : 0;
+    econf.row_off = row_off <= econf.cy ? row_off : econf.cy;
+    econf.col_off = col_off;
+    b->reloaded = 1;
+    b->reload_edits = econf.edits;
+    if (st.st_size != b->file_size || st.st_mtime != b->file_mtime)
+        editor_set_status_message("%s changed on disk while in the background", econf.filename);
+}
 
-    static int saved_hl_line;
-    static char *saved_hl = NULL;
+/* Leaves the current buffer for buffer i. */
+void editor_buffer_switch(int i) {
+    struct editor_buffer *from = &econf.buffers[econf.cur_buffer];
+    editor_buffer_usage(&econf, &from->text_bytes, &from->derived_bytes);
+    from->used = ++econf.buffer_clock;
+    editor_buffer_swap(i);
+
+    struct editor_buffer *b = &econf.buffers[i];
+    editor_set_status_message("Buffer %d/%d: %s", i + 1, econf.num_buffers,
+                              econf.filename ? econf.filename : "[No Name]");
+    if (b->dropped) editor_buffer_reload(b);
+    if (econf.wrap && econf.wrap->num_rows != econf.num_rows)
+        editor_wrap_rebuild(econf.wrap);
+    editor_buffers_trim();
+}
 
-    if (saved_hl) {
-        memcpy(econf.row[saved_hl_line].hl, saved_hl, econf.row[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl = NULL;
+void editor_buffer_next() {
+    if (econf.num_buffers == 1) {
+        editor_set_status_message("No other buffers (Ctrl-O to open one)");
+        return;
     }
+    editor_buffer_switch((econf.cur_buffer + 1) % econf.num_buffers);
+}
 
-    if (key == '\r' || key == '\x1b') {
-        last_match = -1;
-        direction = 1;
+/* Opens filename in a new buffer, or switches to the buffer that has it
+ * open already. A file that does not exist yet starts an empty buffer. */
+void editor_buffer_open(char *filename) {
+    for (int i = 0; i < econf.num_buffers; i++) {
+        char *name = i == econf.cur_buffer ? econf.filename : econf.buffers[i].conf.filename;
+        if (name && !strcmp(name, filename)) {
+            if (i != econf.cur_buffer) editor_buffer_switch(i);
+            return;
+        }
+    }
+    int exists = access(filename, F_OK) == 0;
+    if (exists && access(filename, R_OK) == -1) {
+        editor_set_status_message("Can't open %s: %s", filename, strerror(errno));
         return;
-    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-        direction = 1;
-    } else if (key == ARROW_LEFT || key == ARROW_UP) {
-        direction = -1;
-    } else {
-        last_match = -1;
-        direction = 1;
     }
 
-    if (last_match == -1) direction = 1;
-    int current = last_match;
-    int i;
-    for (i = 0; i < econf.num_rows; i++) {
-        current += direction;
-        if (current == -1) current = econf.num_rows - 1;
-        else if (current == econf.num_rows) current = 0;
-
-        erow *row = &econf.row[current];
-        char *match = strstr(row->render, query);
-        if (match) {
-            last_match = current;
-            econf.cy = current;
-            econf.cx = editor_row_rx_to_cx(row, match - row->render);
-            econf.row_off = econf.num_rows;
-
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
-        }
+    econf.buffers = realloc(econf.buffers, sizeof(struct editor_buffer) * (econf.num_buffers + 1));
+    memset(&econf.buffers[econf.num_buffers], 0, sizeof(struct editor_buffer));
+    econf.num_buffers++;
+    editor_buffer_switch(econf.num_buffers - 1);
+    editor_init_buffer();
+    if (exists) {
+        editor_open(filename);
+        editor_set_status_message("Buffer %d/%d: %s", econf.cur_buffer + 1, econf.num_buffers,
+                                  filename);
+    } else {
+        econf.filename = strdup(filename);
+        editor_select_syntax_highlight();
+        editor_set_status_message("Buffer %d/%d: %s (new file)", econf.cur_buffer + 1,
+                                  econf.num_buffers, filename);
     }
+    editor_buffers_trim();
 }
 
-void editor_find() {
-    int saved_cx = econf.cx;
-    int saved_cy = econf.cy;
-    int saved_col_off = econf.col_off;
-    int saved_row_off = econf.row_off;
+void editor_buffer_prompt() {
+    char *filename = editor_prompt("Open: %s (ESC to cancel)", NULL, 0);
+    if (filename == NULL) return;
+    editor_buffer_open(filename);
+    free(filename);
+}
 
-    char *query = editor_prompt("Search: %s (Use ESC/Arrows/Enter)", editor_find_callback);
+/* Returns how many buffers have unsaved changes. */
+int editor_buffers_dirty() {
+    int n = 0;
+    for (int i = 0; i < econf.num_buffers; i++)
+        n += i == econf.cur_buffer ? econf.dirty != 0 : econf.buffers[i].conf.dirty != 0;
+    return n;
+}
 
-    if (query) {
-        free(query);
-    } else {
-        econf.cx = saved_cx;
-        econf.cy = saved_cy;
-        econf.col_off = saved_col_off;
-        econf.row_off = saved_row_off;
+/* Writes the session cache of every buffer, as is done on quit. */
+void editor_buffers_save_sessions() {
+    int cur = econf.cur_buffer;
+    for (int i = 0; i < econf.num_buffers; i++) {
+        if (i != cur && econf.buffers[i].dropped) continue;
+        editor_buffer_swap(i);
+        editor_session_save();
     }
+    editor_buffer_swap(cur);
 }
 
 /* *** INPUT *** */
 
-char *editor_prompt(char *prompt, void (*callback)(char *, int)) {
+/* Reads a line in the status bar. Enter on an empty line is ignored
+ * unless allow_empty is set. Returns NULL if the prompt is cancelled. */
+char *editor_prompt(char *prompt, void (*callback)(char *, int), int allow_empty) {
     size_t bufsize = 128;
     char *buf = malloc(bufsize);
 
@@ -723,7 +3941,10 @@ char *editor_prompt(char *prompt, void (*callback)(char *, int)) {
 
     while (1) {
         editor_set_status_message(prompt, buf);
-        editor_refresh_screen();
+        if (editor_input_pending())
+            editor_scroll();
+        else
+            editor_refresh_screen();
 
         int c = editor_read_key();
         if (c == DELETE_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
@@ -735,7 +3956,7 @@ char *editor_prompt(char *prompt, void (*callback)(char *, int)) {
             free(buf);
             return NULL;
         } else if (c == '\r') {
-            if (buflen != 0) {
+            if (buflen != 0 || allow_empty) {
                 editor_set_status_message("");
                 if (callback) callback(buf, c);
                 return buf;
@@ -762,7 +3983,7 @@ void editor_move_cursor(int key) {
     case 'h':
     case ARROW_LEFT:
         if (econf.cx > 0) {
-            econf.cx--;
+            econf.cx = editor_row_prev_cx(row, econf.cx);
         } else if (econf.cy > 0){
             econf.cy--;
             econf.cx = econf.row[econf.cy].size;
@@ -783,7 +4004,7 @@ void editor_move_cursor(int key) {
     case 'l':
     case ARROW_RIGHT:
         if (row && econf.cx < row->size) {
-            econf.cx++;
+            econf.cx = editor_row_next_cx(row, econf.cx);
         } else if (row && econf.cx == row->size) {
             econf.cy++;
             econf.cx = 0;
@@ -791,11 +4012,18 @@ void editor_move_cursor(int key) {
         break;
     }
 
+    /* While loading, the rest of the file still follows the last row, so
+     * there is no line past the end to move onto yet. */
+    if (econf.loader && econf.num_rows > 0 && econf.cy >= econf.num_rows)
+        econf.cy = econf.num_rows - 1;
+
     row = (econf.cy >= econf.num_rows) ? NULL : &econf.row[econf.cy];
     int row_len = row ? row->size : 0;
     if (econf.cx > row_len) {
-        econf.cx = row->size;
+        econf.cx = row_len;
     }
+    if (row)
+        econf.cx = utf8_char_start(row->chars, row->size, econf.cx);
 }
 
 void editor_process_keypress() {
@@ -807,12 +4035,18 @@ void editor_process_keypress() {
         editor_insert_newline();
         break;
     case CTRL_KEY('q'):
-        if (econf.dirty && quit_times > 0) {
-            editor_set_status_message("WARNING!! File has unsaved changes. "
-                                      "Press Ctrl-Q %d more times to quit.", quit_times);
+        if (editor_buffers_dirty() && quit_times > 0) {
+            if (econf.num_buffers > 1)
+                editor_set_status_message("WARNING!! %d buffer(s) have unsaved changes. "
+                                          "Press Ctrl-Q %d more times to quit.",
+                                          editor_buffers_dirty(), quit_times);
+            else
+                editor_set_status_message("WARNING!! File has unsaved changes. "
+                                          "Press Ctrl-Q %d more times to quit.", quit_times);
             quit_times--;
             return;
         }
+        editor_buffers_save_sessions();
         clear_screen();
         exit(0);
         break;
@@ -852,6 +4086,59 @@ void editor_process_keypress() {
         editor_find();
         break;
 
+    case CTRL_KEY('t'):
+        editor_follow_toggle();
+        break;
+
+    case CTRL_KEY('r'):
+        editor_replace();
+        break;
+
+    case CTRL_KEY('z'):
+        editor_undo();
+        break;
+
+    case CTRL_KEY('b'):
+        editor_toggle_mark();
+        break;
+
+    case CTRL_KEY('x'):
+    case CTRL_KEY('c'):
+        editor_copy(c == CTRL_KEY('x'));
+        break;
+
+    case CTRL_KEY('v'):
+        editor_paste();
+        break;
+
+    case CTRL_KEY('p'):
+        editor_filter();
+        break;
+
+    case CTRL_KEY('d'):
+        editor_diff();
+        break;
+
+    case CTRL_KEY('g'):
+        editor_show_output_stats();
+        break;
+
+    case CTRL_KEY('w'):
+        editor_wrap_toggle();
+        break;
+
+    case CTRL_KEY('e'):
+        editor_table_toggle();
+        break;
+
+    case CTRL_KEY('o'):
+        editor_buffer_prompt();
+        break;
+
+    case CTRL_KEY('n'):
+        editor_buffer_next();
+        break;
+
     case PAGE_UP:
     case PAGE_DOWN:
         {
@@ -882,144 +4169,608 @@ void editor_process_keypress() {
 
 /* *** OUTPUT *** */
 
+/* Returns how many columns of text are shown: the diff view gives the
+ * left half of the screen to the buffer. */
+int editor_text_cols() {
+    return econf.diff ? (econf.screen_cols - 1) / 2 : econf.screen_cols;
+}
+
+/* View lines are the lines of the screen's text area as if it were as tall
+ * as the file: the rows themselves, unless the diff view adds filler lines
+ * between them or soft wrap continues rows on the lines below. */
+int editor_view_line(int row) {
+    if (econf.diff) return editor_diff_row_line(row);
+    if (econf.wrap) return editor_wrap_row_line(econf.wrap, row);
+    return row;
+}
+
+int editor_view_top() {
+    if (econf.diff) return econf.diff->top;
+    if (econf.wrap) return econf.wrap->top;
+    return econf.row_off;
+}
+
 void editor_scroll() {
     econf.rx = 0;
     if (econf.cy < econf.num_rows) {
         econf.rx = editor_row_cx_to_rx(&econf.row[econf.cy], econf.cx);
     }
 
-    if (econf.cy < econf.row_off) {
-        econf.row_off = econf.cy;
+    if (econf.wrap) {
+        editor_wrap_scroll();
+        return;
     }
-    if (econf.cy >= econf.row_off + econf.screen_rows) {
-        econf.row_off = econf.cy - econf.screen_rows + 1;
+    if (econf.diff) {
+        editor_diff_scroll();
+    } else {
+        if (econf.cy < econf.row_off) {
+            econf.row_off = econf.cy;
+        }
+        if (econf.cy >= econf.row_off + econf.screen_rows) {
+            econf.row_off = econf.cy - econf.screen_rows + 1;
+        }
+        if (econf.table) editor_table_scroll();
     }
+    int cols = editor_text_cols();
     if (econf.rx < econf.col_off) {
         econf.col_off = econf.rx;
     }
-    if (econf.rx >= econf.col_off + econf.screen_cols) {
-        econf.col_off = econf.rx - econf.screen_cols + 1;
+    if (econf.rx >= econf.col_off + cols) {
+        econf.col_off = econf.rx - cols + 1;
     }
 }
 
-void editor_draw_rows(struct abuf *ab) {
-    int y;
-    for (y = 0; y < econf.screen_rows; y++) {
-        int file_row = y + econf.row_off;
-        if (file_row >= econf.num_rows) {
-            if (econf.num_rows == 0 && y == econf.screen_rows / 3) {
-                char welcome[80];
-                int welcome_len = snprintf(welcome, sizeof(welcome),
-                                           "Kilo editor -- version %s", KILO_VERSION);
-                if (welcome_len > econf.screen_cols)
-                    welcome_len = econf.screen_cols;
-                int padding = (econf.screen_cols - welcome_len) / 2;
-                if (padding) {
-                    ab_append(ab, "~", 1);
-                    padding--;
-                }
-                while (padding--) ab_append(ab, " ", 1);
-                ab_append(ab, welcome, welcome_len);
-            } else {
-                ab_append(ab, "~", 1);
+/* Frames are drawn into a grid of cells covering the whole screen and
+ * compared with the grid the terminal was last brought to, so only cells
+ * that changed are sent. */
+int cell_len(cell *c) {
+    int len = 0;
+    while (len < (int)sizeof(c->ch) && c->ch[len]) len++;
+    return len;
+}
+
+/* Adds the zero-width mark s[0, len) to the character in c, if it fits. */
+void cell_append(cell *c, const char *s, int len) {
+    int n = cell_len(c);
+    if (n > 0 && n + len <= (int)sizeof(c->ch))
+        memcpy(&c->ch[n], s, len);
+}
+
+/* Puts the character s[0, len), width columns wide, at column x of line,
+ * drawing nothing at or past column end. A character that is cut off at
+ * either edge shows as blanks. */
+void editor_put_glyph(cell *line, int x, int end, const char *s, int len, int width,
+                      unsigned char attr) {
+    int whole = (x >= 0 && x + width <= end);
+    for (int k = 0; k < width; k++) {
+        if (x + k < 0 || x + k >= end) continue;
+        cell *c = &line[x + k];
+        memset(c->ch, 0, sizeof(c->ch));
+        if (!whole)
+            c->ch[0] = ' ';
+        else if (k == 0)
+            memcpy(c->ch, s, len < (int)sizeof(c->ch) ? len : (int)sizeof(c->ch));
+        c->attr = attr;
+    }
+}
+
+/* Draws s[cx, size), which starts at column rx, into the columns
+ * [col_off, col_off + width) that line holds. Text is coloured by row's
+ * highlighting with attr added, or drawn in attr when row is NULL. Tabs
+ * are expanded, wide characters take two cells, zero-width marks join the
+ * character before them, and control characters and invalid bytes show as
+ * an inverted symbol. Returns the column reached. */
+int editor_draw_chars(cell *line, int width, const char *s, int size, int cx, int rx,
+                      int col_off, erow *row, int attr) {
+    hl_cursor span = HL_CURSOR_INIT;
+    int run_end = cx;
+    int color = attr;
+    int last = -1;      /* the cell of the last character drawn whole */
+
+    while (cx < size && rx < col_off + width) {
+        if (row && cx >= run_end) {
+            int hl = editor_hl_run(row, &span, cx, &run_end);
+            color = ((hl == HL_NORMAL) ? CELL_DEFAULT : editor_syntax_to_color(hl)) | attr;
+        }
+
+        unsigned char c = s[cx];
+        int x = rx - col_off;
+        if (c >= 0x20 && c < 0x7f) {
+            if (x >= 0) {
+                line[x] = CELL_BLANK;
+                line[x].ch[0] = c;
+                line[x].attr = color;
+                last = x;
             }
+            rx++;
+            cx++;
+            continue;
+        }
+
+        int len = 1, cp = c, cols = 1;
+        if (c >= 0x80) {
+            len = utf8_decode(&s[cx], size - cx, &cp);
+            cols = utf8_width(cp);
+        }
+
+        if (c == '\t') {
+            cols = KILO_TAB_STOP - (rx % KILO_TAB_STOP);
+            for (int k = 0; k < cols; k++)
+                editor_put_glyph(line, x + k, width, " ", 1, 1, color);
+            last = -1;
+        } else if (cp < 0x20 || (cp >= 0x7f && cp < 0xa0)) {
+            char sym = (cp >= 0 && cp <= 26) ? '@' + cp : '?';
+            editor_put_glyph(line, x, width, &sym, 1, 1, CELL_INVERSE | CELL_DEFAULT);
+            last = -1;
+        } else if (cols == 0) {
+            if (last >= 0) cell_append(&line[last], &s[cx], len);
         } else {
-            int len = econf.row[file_row].rsize - econf.col_off;
-            if (len < 0) len = 0;
-            if (len > econf.screen_cols)
-                len = econf.screen_cols;
-            char *c = &econf.row[file_row].render[econf.col_off];
-            unsigned char *hl = &econf.row[file_row].hl[econf.col_off];
-            int current_color = -1;
-            int j;
-            for (j = 0; j < len; j++) {
-                if (iscntrl(c[j])) {
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    ab_append(ab, "\x1b[7m", 4);
-                    ab_append(ab, &sym, 1);
-                    ab_append(ab, "\x1b[m", 3);
-                    if (current_color != -1) {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-                        ab_append(ab, buf, clen);
-                    }
-                } else if (hl[j] == HL_NORMAL) {
-                    if (current_color != -1) {
-                        ab_append(ab, "\x1b[39m", 5);
-                        current_color = -1;
-                    }
-                    ab_append(ab, &c[j], 1);
-                } else {
-                    int color = editor_syntax_to_color(hl[j]);
-                    if (color != current_color) {
-                        current_color = color;
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        ab_append(ab, buf, clen);
-                    }
-                    ab_append(ab, &c[j], 1);
-                }
-            }
-            ab_append(ab, "\x1b[39m", 5);
+            editor_put_glyph(line, x, width, &s[cx], len, cols, color);
+            last = (x >= 0 && x + cols <= width) ? x : -1;
         }
-        // TODO: Get the size of the buffer based on how many digits in the text file
-        ab_append(ab, "\x1b[K", 3);
-        ab_append(ab, "\r\n", 2);
+        rx += cols;
+        cx += len;
     }
+    return rx;
 }
 
-void editor_draw_status_bar(struct abuf *ab) {
-    ab_append(ab, "\x1b[7m", 4);
-    char status[80], rstatus[80];
-    char *name = econf.filename ? econf.filename : "[No Name]";
-    int len = snprintf(status, sizeof(status), "%.20s%s", name, econf.dirty ? "*" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-                        econf.syntax ? econf.syntax->filetype : "no ft", econf.cy + 1, econf.num_rows);
+void editor_put_cells(cell *line, int at, const char *s, int len, unsigned char attr) {
+    editor_draw_chars(&line[at], econf.screen_cols - at, s, len, 0, 0, 0, NULL, attr);
+}
 
-    if (len > econf.screen_cols) len = econf.screen_cols;
-    ab_append(ab, status, len);
-    while (len < econf.screen_cols) {
-        if (econf.screen_cols - len == rlen) {
-            ab_append(ab, rstatus, rlen);
-            break;
+/* Returns the attributes added to row for being in the selection. */
+int editor_row_selected(erow *row) {
+    int sel_from, sel_to;
+    return (econf.mark_row >= 0 && editor_selection(&sel_from, &sel_to) &&
+            row->idx >= sel_from && row->idx < sel_to) ? CELL_INVERSE : 0;
+}
+
+/* Draws columns [col_off, col_off + width) of row into line. A row in a
+ * diff hunk is drawn inverted in the colour of diff_hl, not its syntax. */
+void editor_draw_text(cell *line, erow *row, int col_off, int width, int diff_hl) {
+    if (row->hl_pending) editor_update_syntax(row);
+
+    int selected = editor_row_selected(row);
+    int diff_color = diff_hl == HL_NORMAL ? 0 : editor_syntax_to_color(diff_hl) | CELL_INVERSE;
+    for (int x = 0; diff_color && x < width; x++)
+        line[x].attr = diff_color;
+
+    /* In a row of plain ASCII a byte is a column, so drawing starts right
+     * at col_off; other rows are walked from the chunk holding it. */
+    int cx = col_off, rx = col_off;
+    if (row->special) {
+        cx = rx = 0;
+        if (row->chunks) {
+            row_chunk *chunk = &row->chunks[editor_row_find_chunk_rx(row, col_off)];
+            cx = utf8_skip_tail(row->chars, row->size, chunk->cx);
+            rx = chunk->rx;
+        }
+    }
+    int end = editor_draw_chars(line, width, row->chars, row->size, cx, rx, col_off,
+                                diff_color ? NULL : row, diff_color | selected);
+    if (selected && end <= col_off)
+        editor_put_cells(line, 0, " ", 1, CELL_INVERSE | CELL_DEFAULT);
+}
+
+/* Draws text row y of the screen into line, which starts out blank. */
+void editor_draw_row(cell *line, int y) {
+    int file_row = y + econf.row_off;
+    if (file_row >= econf.num_rows) {
+        if (econf.num_rows == 0 && y == econf.screen_rows / 3) {
+            char welcome[80];
+            int welcome_len = snprintf(welcome, sizeof(welcome),
+                                       "Kilo editor -- version %s", KILO_VERSION);
+            if (welcome_len > econf.screen_cols)
+                welcome_len = econf.screen_cols;
+            int padding = (econf.screen_cols - welcome_len) / 2;
+            if (padding)
+                editor_put_cells(line, 0, "~", 1, CELL_DEFAULT);
+            editor_put_cells(line, padding, welcome, welcome_len, CELL_DEFAULT);
         } else {
-            ab_append(ab, " ", 1);
-            len++;
+            editor_put_cells(line, 0, "~", 1, CELL_DEFAULT);
+        }
+    } else {
+        editor_draw_text(line, &econf.row[file_row], econf.col_off, econf.screen_cols, HL_NORMAL);
+    }
+}
+
+void editor_diff_draw_rows(cell *grid) {
+    struct editor_diff *df = econf.diff;
+    int cols = econf.screen_cols;
+    int width = editor_text_cols();
+
+    for (int y = 0; y < econf.screen_rows; y++) {
+        cell *line = &grid[y * cols];
+        int row, file_line;
+        int in_hunk = editor_diff_line(df->top + y, &row, &file_line);
+
+        if (row != -1)
+            editor_draw_text(line, &econf.row[row], econf.col_off, width,
+                             in_hunk ? HL_DIFF_OLD : HL_NORMAL);
+        else if (!in_hunk)
+            editor_put_cells(line, 0, "~", 1, CELL_DEFAULT);
+
+        editor_put_cells(line, width, "|", 1, CELL_INVERSE | CELL_DEFAULT);
+
+        cell *right = &line[width + 1];
+        int right_width = cols - width - 1;
+        if (file_line != -1) {
+            struct diff_line *dl = &df->lines[file_line];
+            int color = in_hunk ? editor_syntax_to_color(HL_DIFF_NEW) | CELL_INVERSE : CELL_DEFAULT;
+            for (int x = 0; in_hunk && x < right_width; x++)
+                right[x].attr = color;
+            editor_draw_chars(right, right_width, dl->chars, dl->size, 0, 0, econf.col_off,
+                              NULL, color);
+        } else if (!in_hunk && right_width > 0) {
+            editor_put_cells(right, 0, "~", 1, CELL_DEFAULT);
         }
     }
-    ab_append(ab, "\x1b[m", 3);
-    ab_append(ab, "\r\n", 2);
 }
 
-void editor_draw_message_bar(struct abuf *ab) {
-    ab_append(ab, "\x1b[K", 3);
+void editor_draw_rows(cell *grid) {
+    if (econf.diff) {
+        editor_diff_draw_rows(grid);
+    } else if (econf.wrap) {
+        editor_wrap_draw_rows(grid);
+    } else if (econf.table) {
+        editor_table_draw_rows(grid);
+    } else {
+        for (int y = 0; y < econf.screen_rows; y++)
+            editor_draw_row(&grid[y * econf.screen_cols], y);
+    }
+}
+
+void editor_draw_status_bar(cell *line) {
+    char status[80], rstatus[80];
+    char *name = econf.filename ? econf.filename : "[No Name]";
+    char which[32] = "";
+    if (econf.num_buffers > 1)
+        snprintf(which, sizeof(which), " [%d/%d]", econf.cur_buffer + 1, econf.num_buffers);
+    int len = snprintf(status, sizeof(status), "%.20s%s%s", name, econf.dirty ? "*" : "", which);
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d%s%s%s",
+                        econf.syntax ? econf.syntax->filetype : "no ft", econf.cy + 1, econf.num_rows,
+                        econf.loader ? " loading..." : "", econf.follow ? " follow" : "",
+                        econf.diff ? " diff" : econf.wrap ? " wrap" : econf.table ? " table" : "");
+
+    for (int x = 0; x < econf.screen_cols; x++)
+        editor_put_cells(line, x, " ", 1, CELL_INVERSE | CELL_DEFAULT);
+    if (len > econf.screen_cols) len = econf.screen_cols;
+    editor_put_cells(line, 0, status, len, CELL_INVERSE | CELL_DEFAULT);
+    if (len + rlen <= econf.screen_cols)
+        editor_put_cells(line, econf.screen_cols - rlen, rstatus, rlen, CELL_INVERSE | CELL_DEFAULT);
+}
+
+void editor_draw_message_bar(cell *line) {
     int msg_len = strlen(econf.status_msg);
     if (msg_len > econf.screen_cols)
         msg_len = econf.screen_cols;
     if (msg_len && time(NULL) - econf.status_msg_time < 5)
-        ab_append(ab, econf.status_msg, msg_len);
+        editor_put_cells(line, 0, econf.status_msg, msg_len, CELL_DEFAULT);
+}
+
+int cell_equal(cell *a, cell *b) {
+    return a->attr == b->attr && !memcmp(a->ch, b->ch, sizeof(a->ch));
+}
+
+int cell_blank(cell *c) {
+    return c->ch[0] == ' ' && c->ch[1] == '\0' && c->attr == CELL_DEFAULT;
+}
+
+/* The right half of a wide character, written along with its left half. */
+int cell_wide_tail(cell *c) {
+    return c->ch[0] == '\0';
+}
+
+void editor_blank_cells(cell *cells, int n) {
+    for (int j = 0; j < n; j++)
+        cells[j] = CELL_BLANK;
+}
+
+/* Appends the SGR sequence that brings the terminal to attr. */
+void editor_emit_attr(struct abuf *ab, int attr) {
+    if (attr == econf.term_attr) return;
+
+    char buf[32];
+    int len = 0;
+    int inverse = attr & CELL_INVERSE;
+    int color = attr & ~CELL_INVERSE;
+    if (econf.term_attr < 0) {
+        len = snprintf(buf, sizeof(buf), "\x1b[0");
+        if (inverse) len += snprintf(buf + len, sizeof(buf) - len, ";7");
+        if (color != CELL_DEFAULT) len += snprintf(buf + len, sizeof(buf) - len, ";%d", color);
+    } else {
+        char *sep = "\x1b[";
+        if (inverse != (econf.term_attr & CELL_INVERSE)) {
+            len += snprintf(buf + len, sizeof(buf) - len, "%s%d", sep, inverse ? 7 : 27);
+            sep = ";";
+        }
+        if (color != (econf.term_attr & ~CELL_INVERSE))
+            len += snprintf(buf + len, sizeof(buf) - len, "%s%d", sep, color);
+    }
+    len += snprintf(buf + len, sizeof(buf) - len, "m");
+    ab_append(ab, buf, len);
+    econf.term_attr = attr;
+}
+
+/* Writes cells at the cursor. Writing the last column leaves the cursor
+ * in the terminal's pending wrap state, kept as term_x == screen_cols. A
+ * wide character moves the cursor over its right half, which has nothing
+ * to write, so the two must be written together. */
+void editor_emit_cells(struct abuf *ab, cell *cells, int n) {
+    for (int j = 0; j < n; j++) {
+        editor_emit_attr(ab, cells[j].attr);
+        ab_append(ab, cells[j].ch, cell_len(&cells[j]));
+    }
+    econf.term_x += n;
+}
+
+int num_digits(int n) {
+    int digits = 1;
+    while (n >= 10) {
+        n /= 10;
+        digits++;
+    }
+    return digits;
+}
+
+/* Builds in buf a move on the cursor row from column from right to column
+ * to, where line holds what the terminal shows on that row. The cells in
+ * between are rewritten rather than skipped when that is shorter and needs
+ * no change of attributes. Returns the length. */
+int editor_move_forward(char *buf, cell *line, int from, int to) {
+    int d = to - from;
+    if (d == 0) return 0;
+
+    int same_attr = 1;
+    for (int x = from; x < to && same_attr; x++)
+        same_attr = (line[x].attr == econf.term_attr && cell_len(&line[x]) == 1);
+    if (same_attr && d <= 3 + (d > 1 ? num_digits(d) : 0)) {
+        for (int x = from; x < to; x++)
+            buf[x - from] = line[x].ch[0];
+        return d;
+    }
+    return (d == 1) ? snprintf(buf, 16, "\x1b[C") : snprintf(buf, 16, "\x1b[%dC", d);
+}
+
+/* Builds in buf the shortest move on the cursor row from column from to
+ * column to. from is screen_cols in the pending wrap state, where only a
+ * carriage return is sure to work. Returns the length. */
+int editor_move_horizontal(char *buf, cell *line, int from, int to) {
+    if (from < econf.screen_cols && to >= from)
+        return editor_move_forward(buf, line, from, to);
+
+    char cr[32];
+    cr[0] = '\r';
+    int cr_len = 1 + editor_move_forward(cr + 1, line, 0, to);
+    if (from < econf.screen_cols) {
+        int len = (from - to == 1) ? snprintf(buf, 16, "\b") : snprintf(buf, 16, "\x1b[%dD", from - to);
+        if (len <= cr_len) return len;
+    }
+    memcpy(buf, cr, cr_len);
+    return cr_len;
+}
+
+/* Appends the cheapest cursor movement to (y, x), given that line is what
+ * the terminal now shows on row y. */
+void editor_emit_move(struct abuf *ab, cell *line, int y, int x) {
+    if (econf.term_y == y && econf.term_x == x) return;
+
+    char best[96];
+    int best_len = (x == 0) ? snprintf(best, sizeof(best), "\x1b[%dH", y + 1)
+                            : snprintf(best, sizeof(best), "\x1b[%d;%dH", y + 1, x + 1);
+
+    if (econf.term_y >= 0 && econf.term_x >= 0) {
+        char buf[96];
+        int len = 0;
+        int dy = y - econf.term_y;
+        if (dy > 0 && dy <= 3 && econf.term_x < econf.screen_cols) {
+            /* OPOST is off, so a newline only moves down. */
+            while (len < dy) buf[len++] = '\n';
+        } else if (dy != 0) {
+            len = snprintf(buf, 32, "\x1b[%d%c", abs(dy), dy > 0 ? 'B' : 'A');
+        }
+        len += editor_move_horizontal(buf + len, line, econf.term_x, x);
+        if (len < best_len) {
+            memcpy(best, buf, len);
+            best_len = len;
+        }
+    }
+
+    ab_append(ab, best, best_len);
+    econf.term_y = y;
+    econf.term_x = x;
+}
+
+/* Appends what brings screen row y from old to line, and updates old. */
+void editor_emit_row(struct abuf *ab, int y, cell *line, cell *old) {
+    int cols = econf.screen_cols;
+    int end = cols;
+    while (end > 0 && cell_blank(&line[end - 1])) end--;
+
+    int x = 0;
+    while (x < end) {
+        if (cell_equal(&line[x], &old[x])) {
+            x++;
+            continue;
+        }
+
+        if (x > 0 && cell_wide_tail(&line[x])) x--;
+        int run_end = x + 1;
+        while (run_end < end && !cell_equal(&line[run_end], &old[run_end])) run_end++;
+        while (run_end < end && cell_wide_tail(&line[run_end])) run_end++;
+
+        while (x < run_end) {
+            editor_emit_move(ab, line, y, x);
+
+            /* Long stretches of blanks are erased in place instead. */
+            int blanks = 0;
+            while (x + blanks < run_end && cell_blank(&line[x + blanks])) blanks++;
+            if (blanks >= KILO_ECH_MIN) {
+                char buf[32];
+                editor_emit_attr(ab, CELL_DEFAULT);
+                int len = snprintf(buf, sizeof(buf), "\x1b[%dX", blanks);
+                ab_append(ab, buf, len);
+                x += blanks;
+                continue;
+            }
+
+            int n = blanks;
+            while (x + n < run_end) {
+                int more = 0;
+                while (x + n + more < run_end && cell_blank(&line[x + n + more])) more++;
+                if (more >= KILO_ECH_MIN) break;
+                n += more ? more : 1;
+            }
+            editor_emit_cells(ab, &line[x], n);
+            x += n;
+        }
+    }
+
+    int x0;
+    for (x0 = end; x0 < cols && cell_equal(&line[x0], &old[x0]); x0++);
+    if (x0 < cols) {
+        editor_emit_move(ab, line, y, end);
+        editor_emit_attr(ab, CELL_DEFAULT);
+        ab_append(ab, "\x1b[K", 3);
+    }
+
+    memcpy(old, line, sizeof(cell) * cols);
+}
+
+/* Returns roughly what redrawing the whole of line would cost. */
+int editor_full_row_cost(cell *line) {
+    int cost = 5;   /* erase to the end of the line and move to the next */
+    int attr = CELL_DEFAULT;
+    for (int x = 0; x < econf.screen_cols; x++) {
+        if (line[x].attr != attr) {
+            cost += 5;
+            attr = line[x].attr;
+        }
+        cost += cell_len(&line[x]);
+    }
+    return cost;
+}
+
+/* Writes the grid to ab, skipping what the terminal already shows. When
+ * the view moved vertically and the text rows still on screen match, they
+ * are shifted with a scroll region instead of being sent again. */
+void editor_draw_frame(struct abuf *ab, cell *grid) {
+    int rows = econf.screen_rows + 2;
+    int cols = econf.screen_cols;
+    int y;
+
+    if (econf.frame == NULL) {
+        /* Nothing is known about the screen yet: make every cell differ. */
+        econf.frame = malloc(sizeof(cell) * rows * cols);
+        for (int j = 0; j < rows * cols; j++) {
+            memset(econf.frame[j].ch, 0, sizeof(econf.frame[j].ch));
+            econf.frame[j].attr = 0xff;
+        }
+        econf.term_x = econf.term_y = -1;
+        econf.term_attr = -1;
+    }
+    cell *frame = econf.frame;
+
+    int shift = editor_view_top() - econf.frame_row_off;
+    int text_rows = econf.screen_rows;
+    if (shift != 0 && abs(shift) < text_rows) {
+        size_t row_bytes = sizeof(cell) * cols;
+        int kept = 0, moved = 0;
+        for (y = 0; y < text_rows; y++) {
+            if (!memcmp(&grid[y * cols], &frame[y * cols], row_bytes)) kept++;
+            if (y + shift >= 0 && y + shift < text_rows &&
+                !memcmp(&grid[y * cols], &frame[(y + shift) * cols], row_bytes))
+                moved++;
+        }
+
+        if (moved > kept) {
+            char buf[32];
+            /* Lines scrolled in are cleared with the current attributes. */
+            editor_emit_attr(ab, CELL_DEFAULT);
+            int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r",
+                               text_rows, abs(shift), shift > 0 ? 'S' : 'T');
+            ab_append(ab, buf, len);
+            econf.term_x = econf.term_y = 0;
+
+            if (shift > 0) {
+                memmove(frame, &frame[shift * cols], row_bytes * (text_rows - shift));
+                editor_blank_cells(&frame[(text_rows - shift) * cols], shift * cols);
+            } else {
+                memmove(&frame[-shift * cols], frame, row_bytes * (text_rows + shift));
+                editor_blank_cells(frame, -shift * cols);
+            }
+        }
+    }
+    econf.frame_row_off = editor_view_top();
+
+    for (y = 0; y < rows; y++) {
+        econf.out_full_bytes += editor_full_row_cost(&grid[y * cols]);
+        editor_emit_row(ab, y, &grid[y * cols], &frame[y * cols]);
+    }
 }
 
 void editor_refresh_screen() {
     editor_scroll();
 
-    struct abuf ab = ABUF_INIT;
+    int rows = econf.screen_rows + 2;
+    int cols = econf.screen_cols;
+    cell *grid = malloc(sizeof(cell) * rows * cols);
+    editor_blank_cells(grid, rows * cols);
+    editor_draw_rows(grid);
+    editor_draw_status_bar(&grid[econf.screen_rows * cols]);
+    editor_draw_message_bar(&grid[(econf.screen_rows + 1) * cols]);
 
+    struct abuf ab = ABUF_INIT;
     ab_append(&ab, "\x1b[?25l", 6);
-    ab_append(&ab, "\x1b[H", 3);
-
-    editor_draw_rows(&ab);
-    editor_draw_status_bar(&ab);
-    editor_draw_message_bar(&ab);
+    editor_draw_frame(&ab, grid);
+    free(grid);
 
     char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (econf.cy - econf.row_off) + 1, (econf.rx - econf.col_off) + 1);
+    int y = editor_view_line(econf.cy) - editor_view_top();
+    int x = econf.rx - econf.col_off;
+    if (econf.wrap) {
+        int start;
+        y += editor_wrap_cursor_sub(&start);
+        x = econf.rx - start;
+        if (x >= econf.wrap->width) x = econf.wrap->width - 1;
+    }
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
     ab_append(&ab, buf, strlen(buf));
+    econf.term_y = y;
+    econf.term_x = x;
 
     ab_append(&ab, "\x1b[?25h", 6);
 
     write(STDOUT_FILENO, ab.b, ab.len);
+    econf.out_frames++;
+    econf.out_bytes += ab.len;
+    econf.out_full_bytes += 12 + strlen(buf);
     ab_free(&ab);
+    econf.frame_time = editor_now_ms();
+    econf.redraw_pending = 0;
+}
+
+void editor_show_output_stats() {
+    if (econf.out_frames == 0) return;
+    editor_set_status_message("%ld frames, %ld bytes/frame, %ld%% less than full redraws",
+                              econf.out_frames, econf.out_bytes / econf.out_frames,
+                              100 - econf.out_bytes * 100 / econf.out_full_bytes);
+}
+
+/* Runs between keypresses, whenever reading a key times out. Returns 1 if
+ * there is more background work ready to be done right away. */
+int editor_background_tick() {
+    int more, filter_more;
+    int changed = editor_loader_poll(&more);
+    changed |= editor_follow_poll();
+    changed |= editor_filter_poll(&filter_more);
+    more |= filter_more;
+    /* When it is too soon for another frame, a later tick draws it. */
+    if (changed)
+        econf.redraw_pending = 1;
+    if (econf.redraw_pending && editor_frame_delay() == 0)
+        editor_refresh_screen();
+    return more;
 }
 
 void editor_set_status_message(const char *fmt, ...) {
@@ -1072,18 +4823,34 @@ int get_window_size(int *rows, int *cols) {
 }
 
 void init_editor() {
-    econf.cx = 0;
-    econf.cy = 0;
-    econf.rx = 0;
-    econf.row_off = 0;
-    econf.col_off = 0;
-    econf.num_rows = 0;
-    econf.row = NULL;
-    econf.dirty = 0;
-    econf.filename = NULL;
+    utf8_init_width_pages();
+    editor_init_buffer();
     econf.status_msg[0] = '\0';
     econf.status_msg_time = 0;
-    econf.syntax = NULL;
+    econf.frame = NULL;
+    econf.frame_row_off = 0;
+    econf.out_frames = 0;
+    econf.out_bytes = 0;
+    econf.out_full_bytes = 0;
+    econf.frame_time = 0;
+    econf.redraw_pending = 0;
+
+    int fps = KILO_MAX_FPS;
+    char *env_fps = getenv("KILO_FPS");
+    if (env_fps) fps = atoi(env_fps);
+    econf.frame_interval = fps > 0 ? 1000 / fps : 0;
+    econf.kill_lines = NULL;
+    econf.kill_lens = NULL;
+    econf.kill_num = 0;
+
+    econf.buffers = calloc(1, sizeof(struct editor_buffer));
+    econf.num_buffers = 1;
+    econf.cur_buffer = 0;
+    econf.buffer_clock = 0;
+    long mb = KILO_MEM_BUDGET_MB;
+    char *env_mb = getenv("KILO_MEM_MB");
+    if (env_mb) mb = atol(env_mb);
+    econf.mem_budget = (size_t)(mb > 0 ? mb : 0) << 20;
 
     if (get_window_size(&econf.screen_rows, &econf.screen_cols) == -1)
         die("get_window_size");
@@ -1101,7 +4868,12 @@ int main(int argc, char *argv[]) {
 
     while (1) {
         editor_refresh_screen();
-        editor_process_keypress();
+        do {
+            editor_process_keypress();
+            /* Keys like PAGE_DOWN go by the scroll offsets, so keep them
+             * current even for keys that get no frame of their own. */
+            editor_scroll();
+        } while (editor_input_pending());
     }
     return 0;
 }